@@ -534,6 +534,12 @@ namespace RTLIB {
     // Deoptimization.
     DEOPTIMIZE,
 
+    // In-place i64 helpers.
+    ADD_I64,
+    SUB_I64,
+    CMP_I64,
+    SCMP_I64,
+
     UNKNOWN_LIBCALL
   };
 
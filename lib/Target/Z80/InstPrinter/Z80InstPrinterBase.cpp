@@ -81,7 +81,13 @@ void Z80InstPrinterBase::printOff(const MCInst *MI, unsigned Op,
 void Z80InstPrinterBase::printAddr(const MCInst *MI, unsigned Op,
                                    raw_ostream &OS) {
   printOperand(MI, Op, OS);
-  int8_t Off = MI->getOperand(Op+1).getImm();
-  assert(Off == MI->getOperand(Op+1).getImm() && "Offset out of range!");
-  OS << " + " << int(MI->getOperand(Op+1).getImm());
+  const MCOperand &OffOp = MI->getOperand(Op+1);
+  if (OffOp.isExpr()) {
+    OS << " + ";
+    OffOp.getExpr()->print(OS, &MAI);
+    return;
+  }
+  int8_t Off = OffOp.getImm();
+  assert(Off == OffOp.getImm() && "Offset out of range!");
+  OS << " + " << int(OffOp.getImm());
 }
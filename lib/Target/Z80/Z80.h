@@ -20,8 +20,13 @@
 
 namespace llvm {
 class FunctionPass;
+class PassRegistry;
 class Z80TargetMachine;
 
+/// Return an IR pass that narrows promoted integer arithmetic, phis and
+/// compares to i8 where the high bytes are unused or known.
+FunctionPass *createZ80IntegerNarrowingPass();
+
 /// This pass converts a legalized DAG into a Z80-specific DAG, ready for
 /// instruction scheduling.
 FunctionPass *createZ80ISelDag(Z80TargetMachine &TM,
@@ -38,6 +43,16 @@ FunctionPass *createZ80ExpandPseudoPass();
 
 /// Return a pass that optimizes instructions after register selection.
 FunctionPass *createZ80MachineLateOptimization();
+
+/// Return a pass that replaces spill slots whose store and reload nest within
+/// a block with push/pop pairs.
+FunctionPass *createZ80PushPopSpills();
+
+/// Return a pass that lowers register swaps made of three copies as
+/// exchanges.
+FunctionPass *createZ80CopyShuffles();
+
+void initializeZ80IntegerNarrowingPass(PassRegistry &);
 } // End llvm namespace
 
 #endif
@@ -14,6 +14,7 @@
 
 #include "Z80AsmPrinter.h"
 #include "Z80.h"
+#include "InstPrinter/Z80InstPrinter.h"
 #include "MCTargetDesc/Z80TargetStreamer.h"
 #include "llvm/MC/MCContext.h"
 #include "llvm/MC/MCStreamer.h"
@@ -85,6 +86,57 @@ void Z80AsmPrinter::EmitGlobalVariable(const GlobalVariable *GV) {
   OutStreamer->AddBlankLine();
 }
 
+bool Z80AsmPrinter::PrintAsmOperand(const MachineInstr *MI, unsigned OpNo,
+                                    unsigned AsmVariant, const char *ExtraCode,
+                                    raw_ostream &OS) {
+  if (ExtraCode && ExtraCode[0])
+    return AsmPrinter::PrintAsmOperand(MI, OpNo, AsmVariant, ExtraCode, OS);
+  const MachineOperand &MO = MI->getOperand(OpNo);
+  switch (MO.getType()) {
+  default:
+    return true;
+  case MachineOperand::MO_Register:
+    OS << Z80InstPrinter::getRegisterName(MO.getReg());
+    return false;
+  case MachineOperand::MO_Immediate:
+    OS << MO.getImm();
+    return false;
+  case MachineOperand::MO_GlobalAddress:
+    getSymbol(MO.getGlobal())->print(OS, MAI);
+    printOffset(MO.getOffset(), OS);
+    return false;
+  case MachineOperand::MO_ExternalSymbol:
+    GetExternalSymbolSymbol(MO.getSymbolName())->print(OS, MAI);
+    return false;
+  }
+}
+
+/// Memory operands are a base register and a displacement, which can only be
+/// nonzero for the index registers.
+bool Z80AsmPrinter::PrintAsmMemoryOperand(const MachineInstr *MI,
+                                          unsigned OpNo, unsigned AsmVariant,
+                                          const char *ExtraCode,
+                                          raw_ostream &OS) {
+  if (ExtraCode && ExtraCode[0])
+    return true;
+  const MachineOperand &Base = MI->getOperand(OpNo);
+  const MachineOperand &Off = MI->getOperand(OpNo + 1);
+  if (!Base.isReg() || !Off.isImm())
+    return true;
+  unsigned Reg = Base.getReg();
+  bool IsIndex = Z80::I16RegClass.contains(Reg) ||
+                 Z80::I24RegClass.contains(Reg);
+  if (!IsIndex && Off.getImm())
+    return true;
+  OS << '(' << Z80InstPrinter::getRegisterName(Reg);
+  if (IsIndex) {
+    int64_t Disp = Off.getImm();
+    OS << (Disp < 0 ? " - " : " + ") << (Disp < 0 ? -Disp : Disp);
+  }
+  OS << ')';
+  return false;
+}
+
 // Force static initialization.
 extern "C" void LLVMInitializeZ80AsmPrinter() {
   RegisterAsmPrinter<Z80AsmPrinter> X(TheZ80Target);
@@ -33,6 +33,13 @@ public:
   void EmitEndOfAsmFile(Module &M) override;
   void EmitGlobalVariable(const GlobalVariable *GV) override;
   void EmitInstruction(const MachineInstr *MI) override;
+
+  bool PrintAsmOperand(const MachineInstr *MI, unsigned OpNo,
+                       unsigned AsmVariant, const char *ExtraCode,
+                       raw_ostream &OS) override;
+  bool PrintAsmMemoryOperand(const MachineInstr *MI, unsigned OpNo,
+                             unsigned AsmVariant, const char *ExtraCode,
+                             raw_ostream &OS) override;
 };
 } // End llvm namespace
 
@@ -0,0 +1,173 @@
+//===-- Z80CopyShuffles.cpp - Lower register swaps as exchanges -----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines a pass that finds register swaps left behind by register
+// allocation, which show up as three copies rotating through a temporary, and
+// lowers each one as a single exchange.  DE and HL are swapped with EX DE,HL,
+// and HL, IX or IY with another pair through EX (SP) when that is smaller or
+// the copies would have gone through the stack anyway.  Copies are otherwise
+// expanded one at a time by Z80InstrInfo::copyPhysReg, which can't see that
+// two of them form a swap.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Z80.h"
+#include "Z80InstrInfo.h"
+#include "Z80MachineFunctionInfo.h"
+#include "Z80Subtarget.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/CodeGen/MachineFunctionPass.h"
+#include "llvm/CodeGen/MachineInstrBuilder.h"
+using namespace llvm;
+
+#define DEBUG_TYPE "z80-copy-shuffles"
+
+STATISTIC(NumSwaps, "Number of register swaps lowered as exchanges");
+
+namespace {
+class Z80CopyShuffles : public MachineFunctionPass {
+public:
+  Z80CopyShuffles() : MachineFunctionPass(ID) {}
+
+  bool runOnMachineFunction(MachineFunction &MF) override;
+
+  MachineFunctionProperties getRequiredProperties() const override {
+    return MachineFunctionProperties()
+      .set(MachineFunctionProperties::Property::NoVRegs);
+  }
+
+  StringRef getPassName() const override {
+    return "Z80 Copy Shuffles";
+  }
+
+private:
+  bool isSwap(MachineInstr &First, MachineInstr &Second, MachineInstr &Third,
+              unsigned &RegA, unsigned &RegB) const;
+  bool lowerSwap(MachineBasicBlock &MBB, MachineInstr &InsertPt,
+                 unsigned RegA, unsigned RegB) const;
+
+  const Z80Subtarget *STI;
+  const Z80InstrInfo *TII;
+  const TargetRegisterInfo *TRI;
+
+  static char ID;
+};
+
+char Z80CopyShuffles::ID = 0;
+} // end anonymous namespace
+
+FunctionPass *llvm::createZ80CopyShuffles() {
+  return new Z80CopyShuffles();
+}
+
+/// Return true if First, Second and Third are the copies
+///   Tmp = RegA; RegA = RegB; RegB = Tmp<kill>
+/// which together swap RegA and RegB.
+bool Z80CopyShuffles::isSwap(MachineInstr &First, MachineInstr &Second,
+                             MachineInstr &Third,
+                             unsigned &RegA, unsigned &RegB) const {
+  if (!First.isCopy() || !Second.isCopy() || !Third.isCopy())
+    return false;
+  unsigned TmpReg = First.getOperand(0).getReg();
+  RegA = First.getOperand(1).getReg();
+  RegB = Second.getOperand(1).getReg();
+  if (Second.getOperand(0).getReg() != RegA ||
+      Third.getOperand(0).getReg() != RegB ||
+      Third.getOperand(1).getReg() != TmpReg)
+    return false;
+  if (TRI->regsOverlap(RegA, RegB) || TRI->regsOverlap(RegA, TmpReg) ||
+      TRI->regsOverlap(RegB, TmpReg))
+    return false;
+  // The temporary ends up holding the old RegA, which the exchange doesn't
+  // reproduce, so it has to die here.
+  MachineBasicBlock &MBB = *Third.getParent();
+  return Third.killsRegister(TmpReg, TRI) ||
+    MBB.computeRegisterLiveness(TRI, TmpReg,
+                                std::next(Third.getIterator())) ==
+      MachineBasicBlock::LQR_Dead;
+}
+
+/// Build an exchange of RegA and RegB before InsertPt, returning false if
+/// three copies are as good.
+bool Z80CopyShuffles::lowerSwap(MachineBasicBlock &MBB, MachineInstr &InsertPt,
+                                unsigned RegA, unsigned RegB) const {
+  bool Is24Bit = STI->is24Bit();
+  // Exchanging whole registers in the other mode would clobber or ignore the
+  // upper byte.
+  const TargetRegisterClass &RC = Is24Bit ? Z80::R24RegClass
+                                          : Z80::R16RegClass;
+  if (!RC.contains(RegA, RegB))
+    return false;
+  DebugLoc DL = InsertPt.getDebugLoc();
+  unsigned DE = Is24Bit ? Z80::UDE : Z80::DE;
+  unsigned HL = Is24Bit ? Z80::UHL : Z80::HL;
+  if ((RegA == DE && RegB == HL) || (RegA == HL && RegB == DE)) {
+    BuildMI(MBB, InsertPt, DL, TII->get(Is24Bit ? Z80::EX24DE : Z80::EX16DE));
+    return true;
+  }
+
+  // Otherwise push one pair and exchange the other with the top of stack,
+  // which needs HL, IX or IY for the exchange.
+  const TargetRegisterClass &ARC = Is24Bit ? Z80::A24RegClass
+                                           : Z80::A16RegClass;
+  const TargetRegisterClass &IRC = Is24Bit ? Z80::I24RegClass
+                                           : Z80::I16RegClass;
+  if (!ARC.contains(RegA) && !ARC.contains(RegB))
+    return false;
+  // Pushing, EX (SP) and popping is three instructions but much slower than
+  // three byte pair copies, unless those copies go through the stack as well.
+  bool OptSize = MBB.getParent()->getInfo<Z80MachineFunctionInfo>()
+    ->shouldOptForSize(&MBB);
+  if (!OptSize && !Is24Bit && !IRC.contains(RegA) && !IRC.contains(RegB))
+    return false;
+  unsigned ArgReg = ARC.contains(RegA) && RegB != HL ? RegA : RegB;
+  unsigned OtherReg = ArgReg == RegA ? RegB : RegA;
+  BuildMI(MBB, InsertPt, DL, TII->get(Is24Bit ? Z80::PUSH24r : Z80::PUSH16r))
+    .addReg(OtherReg, RegState::Kill);
+  BuildMI(MBB, InsertPt, DL, TII->get(Is24Bit ? Z80::EX24SP : Z80::EX16SP),
+          ArgReg).addReg(ArgReg);
+  BuildMI(MBB, InsertPt, DL, TII->get(Is24Bit ? Z80::POP24r : Z80::POP16r),
+          OtherReg);
+  return true;
+}
+
+bool Z80CopyShuffles::runOnMachineFunction(MachineFunction &MF) {
+  if (skipFunction(*MF.getFunction()))
+    return false;
+  STI = &MF.getSubtarget<Z80Subtarget>();
+  TII = STI->getInstrInfo();
+  TRI = STI->getRegisterInfo();
+
+  bool Changed = false;
+  for (auto &MBB : MF)
+    for (auto I = MBB.begin(), E = MBB.end(); I != E;) {
+      MachineInstr &First = *I++;
+      if (!First.isCopy())
+        continue;
+      auto J = skipDebugInstructionsForward(I, E);
+      if (J == E)
+        break;
+      auto K = skipDebugInstructionsForward(std::next(J), E);
+      if (K == E)
+        break;
+      unsigned RegA, RegB;
+      if (!isSwap(First, *J, *K, RegA, RegB) ||
+          !lowerSwap(MBB, First, RegA, RegB))
+        continue;
+      DEBUG(dbgs() << "Swapping " << TRI->getName(RegA) << " and "
+                   << TRI->getName(RegB) << '\n');
+      I = std::next(K);
+      K->eraseFromParent();
+      J->eraseFromParent();
+      First.eraseFromParent();
+      ++NumSwaps;
+      Changed = true;
+    }
+  return Changed;
+}
@@ -11,32 +11,28 @@
 // instructions to allow proper scheduling, if-conversion, other late
 // optimizations, or simply the encoding of the instructions.
 //
+// Pseudos that become a single instruction are rewritten in place by
+// Z80InstrInfo::expandPostRAPseudo.  The ones handled here turn into short
+// sequences: word compares, byte pair accesses on cores without 16-bit loads,
+// and pointer update accesses.  This runs after ExpandPostRAPseudos, so that
+// the post-RA scheduler and the late peepholes see the real instructions, and
+// before the pre-emit passes, so that branch size accounting is exact.
+//
 //===----------------------------------------------------------------------===//
 
 #include "Z80.h"
 #include "Z80InstrInfo.h"
+#include "Z80MachineFunctionInfo.h"
 #include "Z80Subtarget.h"
-#include "../../CodeGen/LiveDebugVariables.h"
-#include "../../CodeGen/SpillPlacement.h"
-#include "llvm/CodeGen/CalcSpillWeights.h"
-#include "llvm/CodeGen/EdgeBundles.h"
-#include "llvm/CodeGen/LiveIntervalAnalysis.h"
-#include "llvm/CodeGen/LiveRangeEdit.h"
-#include "llvm/CodeGen/LiveRegMatrix.h"
-#include "llvm/CodeGen/LiveStackAnalysis.h"
-#include "llvm/CodeGen/MachineBlockFrequencyInfo.h"
-#include "llvm/CodeGen/MachineDominators.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/CodeGen/MachineFunctionPass.h"
-#include "llvm/CodeGen/MachineInstr.h"
 #include "llvm/CodeGen/MachineInstrBuilder.h"
-#include "llvm/CodeGen/MachineLoopInfo.h"
-#include "llvm/CodeGen/MachineRegisterInfo.h"
-#include "llvm/CodeGen/RegAllocRegistry.h"
-#include "llvm/CodeGen/VirtRegMap.h"
 using namespace llvm;
 
 #define DEBUG_TYPE "z80-pseudo"
 
+STATISTIC(NumExpanded, "Number of pseudo instructions expanded");
+
 namespace {
 class Z80ExpandPseudo : public MachineFunctionPass {
 public:
@@ -46,33 +42,11 @@ public:
 
   MachineFunctionProperties getRequiredProperties() const override {
     return MachineFunctionProperties()
-      .set(MachineFunctionProperties::Property::TracksLiveness);
+      .set(MachineFunctionProperties::Property::NoVRegs);
   }
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.setPreservesCFG();
-    AU.addRequired<MachineBlockFrequencyInfo>();
-    AU.addPreserved<MachineBlockFrequencyInfo>();
-    //AU.addRequired<AAResultsWrapperPass>();
-    //AU.addPreserved<AAResultsWrapperPass>();
-    AU.addRequired<LiveIntervals>();
-    AU.addPreserved<LiveIntervals>();
-    AU.addRequired<SlotIndexes>();
-    AU.addPreserved<SlotIndexes>();
-    //AU.addRequired<LiveDebugVariables>();
-    //AU.addPreserved<LiveDebugVariables>();
-    AU.addRequired<LiveStacks>();
-    AU.addPreserved<LiveStacks>();
-    AU.addRequired<MachineDominatorTree>();
-    AU.addPreserved<MachineDominatorTree>();
-    AU.addRequired<MachineLoopInfo>();
-    AU.addPreserved<MachineLoopInfo>();
-    AU.addRequired<VirtRegMap>();
-    AU.addPreserved<VirtRegMap>();
-    AU.addRequired<LiveRegMatrix>();
-    AU.addPreserved<LiveRegMatrix>();
-    AU.addRequired<EdgeBundles>();
-    AU.addRequired<SpillPlacement>();
     MachineFunctionPass::getAnalysisUsage(AU);
   }
 
@@ -81,12 +55,21 @@ public:
   }
 
 private:
-  void ExpandCmp(MachineInstr &MI, MachineBasicBlock &MBB);
-  void ExpandCmp0(MachineInstr &MI, MachineBasicBlock &MBB);
-  bool ExpandMI(MachineBasicBlock::iterator &MI, MachineBasicBlock &MBB);
+  void ExpandCmp(MachineInstr &MI);
+  void ExpandCmp0(MachineInstr &MI);
+  void ExpandLoadPair(MachineInstr &MI);
+  void ExpandStorePair(MachineInstr &MI);
+  void ExpandPointerUpdate(MachineInstr &MI);
+  void Expand(MachineInstr &MI);
+  bool ExpandMI(MachineInstr &MI);
   bool ExpandMBB(MachineBasicBlock &MBB);
 
-  const TargetInstrInfo *TII;
+  const Z80Subtarget *STI;
+  const Z80InstrInfo *TII;
+  const TargetRegisterInfo *TRI;
+  bool Is24Bit;
+  bool UseLEA;
+
   static char ID;
 };
 
@@ -97,60 +80,286 @@ FunctionPass *llvm::createZ80ExpandPseudoPass() {
   return new Z80ExpandPseudo();
 }
 
-void Z80ExpandPseudo::ExpandCmp(MachineInstr &MI, MachineBasicBlock &MBB) {
-  bool Is24Bit = MI.getOpcode() == Z80::CP24ao;
-  assert((Is24Bit || MI.getOpcode() == Z80::CP16ao) && "Unexpected opcode");
+/// Advance the displacement operand MO to the next byte, which may be a
+/// symbolic small data displacement rather than an immediate.
+static void incrementOffset(MachineOperand &MO) {
+  if (MO.isImm())
+    MO.setImm(MO.getImm() + 1);
+  else
+    MO.setOffset(MO.getOffset() + 1);
+}
+
+/// Expand a word compare or subtract into SBC with a cleared carry.  A compare
+/// leaves HL intact, so the subtrahend is added back if HL is still live.
+void Z80ExpandPseudo::ExpandCmp(MachineInstr &MI) {
+  MachineBasicBlock &MBB = *MI.getParent();
+  auto Next = ++MachineBasicBlock::iterator(MI);
   DebugLoc DL = MI.getDebugLoc();
-  dbgs() << "Z80ExpandPseudo::ExpandCmp";
-  MI.dump();
-  //BuildMI(MBB, MI, DL, TII->get(Z80::RCF));
-  //BuildMI(MBB, MI, DL, TII->get(Is24Bit ? Z80::SBC24ar : Z80::SBC16ar))
-  //  .addReg(MI.getOperand(0).getReg());
-  //BuildMI(MBB, MI, DL, TII->get(Is24Bit ? Z80::ADD24ao : Z80::ADD16ao),
-  //        Is24Bit ? Z80::UHL : Z80::HL).addReg(Is24Bit ? Z80::UHL : Z80::HL)
-  //  .addReg(MI.getOperand(0).getReg());
+  unsigned Opc = MI.getOpcode();
+  bool Is24BitOp = Opc == Z80::CP24ao || Opc == Z80::SUB24ao;
+  if (Opc == Z80::CP16ao || Opc == Z80::CP24ao) {
+    unsigned Reg = Is24BitOp ? Z80::UHL : Z80::HL;
+    if (MBB.computeRegisterLiveness(TRI, Reg, Next) !=
+        MachineBasicBlock::LQR_Dead) {
+      BuildMI(MBB, Next, DL, TII->get(Is24BitOp ? Z80::ADD24ao
+                                                : Z80::ADD16ao), Reg)
+        .addReg(Reg).add(MI.getOperand(0));
+      MI.getOperand(0).setIsKill(false);
+    }
+  }
+  Expand(*BuildMI(MBB, MI, DL, TII->get(Z80::RCF)));
+  MI.setDesc(TII->get(Is24BitOp ? Z80::SBC24ao : Z80::SBC16ao));
 }
-void Z80ExpandPseudo::ExpandCmp0(MachineInstr &MI, MachineBasicBlock &MBB) {
-  bool Is24Bit = MI.getOpcode() == Z80::CP24a0;
-  assert((Is24Bit || MI.getOpcode() == Z80::CP16a0) && "Unexpected opcode");
+
+/// Expand a compare of HL against zero.  Adding zero leaves HL unchanged but
+/// clears carry, and the following SBC of the same value sets the flags.
+void Z80ExpandPseudo::ExpandCmp0(MachineInstr &MI) {
+  MachineBasicBlock &MBB = *MI.getParent();
   DebugLoc DL = MI.getDebugLoc();
-  dbgs() << "Z80ExpandPseudo::ExpandCmp";
-  MI.dump();
-  //BuildMI(MBB, MI, DL, TII->get(Is24Bit ? Z80::ADD24ao : Z80::ADD16ao),
-  //        Is24Bit ? Z80::UHL : Z80::HL).addReg(Is24Bit ? Z80::UHL : Z80::HL)
-  //  .addReg(MI.getOperand(0).getReg());
-  //BuildMI(MBB, MI, DL, TII->get(Z80::RCF));
-  //BuildMI(MBB, MI, DL, TII->get(Is24Bit ? Z80::SBC24ar : Z80::SBC16ar))
-  //  .addReg(MI.getOperand(0).getReg());
+  bool Is24BitOp = MI.getOpcode() == Z80::CP24a0;
+  assert((Is24BitOp || MI.getOpcode() == Z80::CP16a0) && "Unexpected opcode");
+  unsigned Reg = Is24BitOp ? Z80::UHL : Z80::HL;
+  unsigned UndefReg = Is24BitOp ? Z80::UBC : Z80::BC;
+  BuildMI(MBB, MI, DL, TII->get(Is24BitOp ? Z80::ADD24ao : Z80::ADD16ao), Reg)
+    .addReg(Reg).addReg(UndefReg, RegState::Undef);
+  Expand(*BuildMI(MBB, MI, DL, TII->get(Z80::RCF)));
+  MI.setDesc(TII->get(Is24BitOp ? Z80::SBC24ao : Z80::SBC16ao));
+  MachineInstrBuilder(*MBB.getParent(), MI)
+    .addReg(UndefReg, RegState::Undef);
 }
 
-bool Z80ExpandPseudo::ExpandMI(MachineBasicBlock::iterator &MI, MachineBasicBlock &MBB) {
-  switch (MI->getOpcode()) {
-  default: return false;
+/// Expand a 16-bit load into two byte loads, borrowing HL or DE when the
+/// destination can't be loaded directly or overlaps the pointer.
+void Z80ExpandPseudo::ExpandLoadPair(MachineInstr &MI) {
+  assert(!STI->has16BitEZ80Ops() &&
+         "LD88rp/LD88ro is not used on the ez80 in 16-bit mode");
+  MachineBasicBlock &MBB = *MI.getParent();
+  auto Next = ++MachineBasicBlock::iterator(MI);
+  DebugLoc DL = MI.getDebugLoc();
+  unsigned NewOpc = MI.getOpcode() == Z80::LD88rp ? Z80::LD8rp : Z80::LD8ro;
+  MachineOperand &DstOp = MI.getOperand(0);
+  const MachineOperand &AddrOp = MI.getOperand(1);
+  unsigned OrigReg = DstOp.getReg();
+  unsigned Reg = OrigReg;
+  bool Index = Z80::I16RegClass.contains(Reg);
+  bool Overlap = NewOpc == Z80::LD8rp && Reg == Z80::HL;
+  unsigned ScratchReg;
+  if (Index || Overlap) {
+    Reg = Index ? Z80::HL : Z80::DE;
+    ScratchReg = Is24Bit ? Index ? Z80::UHL : Z80::UDE : Reg;
+    BuildMI(MBB, MI, DL, TII->get(Is24Bit ? Z80::PUSH24r : Z80::PUSH16r))
+      .addReg(ScratchReg, RegState::Undef);
+  }
+  MachineInstrBuilder MIB =
+    BuildMI(MBB, MI, DL, TII->get(NewOpc), TRI->getSubReg(Reg, Z80::sub_low))
+      .addReg(AddrOp.getReg());
+  if (NewOpc == Z80::LD8rp)
+    BuildMI(MBB, MI, DL, TII->get(Is24Bit ? Z80::INC24r : Z80::INC16r),
+            AddrOp.getReg()).addReg(AddrOp.getReg());
+  MI.setDesc(TII->get(NewOpc));
+  DstOp.setReg(TRI->getSubReg(Reg, Z80::sub_high));
+  if (NewOpc == Z80::LD8ro) {
+    MachineOperand &OffOp = MI.getOperand(2);
+    MIB.add(OffOp);
+    incrementOffset(OffOp);
+  } else if (!AddrOp.isKill())
+    BuildMI(MBB, Next, DL, TII->get(Is24Bit ? Z80::DEC24r : Z80::DEC16r),
+            AddrOp.getReg()).addReg(AddrOp.getReg());
+  if (Index)
+    BuildMI(MBB, Next, DL, TII->get(Is24Bit ? Z80::EX24SP : Z80::EX16SP),
+            ScratchReg).addReg(ScratchReg);
+  else if (Overlap)
+    TII->copyPhysReg(MBB, Next, DL, AddrOp.getReg(), ScratchReg, true);
+  if (Index || Overlap)
+    BuildMI(MBB, Next, DL, TII->get(Is24Bit ? Z80::POP24r : Z80::POP16r),
+            Overlap ? ScratchReg : Is24Bit ?
+                TRI->getMatchingSuperReg(OrigReg, Z80::sub_short,
+                                         &Z80::R24RegClass) : OrigReg);
+  Expand(*MIB);
+  Expand(MI);
+}
+
+/// Expand a 16-bit store into two byte stores, going through HL when the
+/// source is an index register and through A when it overlaps the pointer.
+void Z80ExpandPseudo::ExpandStorePair(MachineInstr &MI) {
+  assert(!STI->has16BitEZ80Ops() &&
+         "LD88pr/LD88or is not used on the ez80 in 16-bit mode");
+  MachineBasicBlock &MBB = *MI.getParent();
+  auto Next = ++MachineBasicBlock::iterator(MI);
+  DebugLoc DL = MI.getDebugLoc();
+  unsigned NewOpc = MI.getOpcode() == Z80::LD88pr ? Z80::LD8pr : Z80::LD8or;
+  const MachineOperand &AddrOp = MI.getOperand(0);
+  MachineOperand &SrcOp = MI.getOperand(MI.getNumExplicitOperands() - 1);
+  unsigned Reg = SrcOp.getReg();
+  bool Index = Z80::I16RegClass.contains(Reg);
+  bool Overlap = NewOpc == Z80::LD8pr && Reg == Z80::HL;
+  unsigned ScratchReg;
+  if (Index || Overlap) {
+    unsigned SuperReg = TRI->getMatchingSuperReg(Reg, Z80::sub_short,
+                                                 &Z80::R24RegClass);
+    ScratchReg = Index ? Is24Bit ? Z80::UHL : Z80::HL : Z80::AF;
+    BuildMI(MBB, MI, DL, TII->get(Is24Bit ? Z80::PUSH24r : Z80::PUSH16r))
+      .addReg(UseLEA || Overlap ? ScratchReg : Is24Bit ? SuperReg : Reg,
+              RegState::Undef);
+    if (Index) {
+      if (UseLEA)
+        BuildMI(MBB, MI, DL, TII->get(Z80::LEA24ro), Z80::UHL)
+          .addReg(SuperReg).addImm(0);
+      else
+        BuildMI(MBB, MI, DL, TII->get(Is24Bit ? Z80::EX24SP : Z80::EX16SP),
+                ScratchReg).addReg(ScratchReg);
+    }
+    Reg = Z80::HL;
+  }
+  MachineInstrBuilder MIB =
+    BuildMI(MBB, MI, DL, TII->get(NewOpc)).addReg(AddrOp.getReg());
+  if (NewOpc == Z80::LD8or) {
+    MachineOperand &OffOp = MI.getOperand(1);
+    MIB.add(OffOp);
+    incrementOffset(OffOp);
+  } else if (!AddrOp.isKill())
+    BuildMI(MBB, Next, DL, TII->get(Is24Bit ? Z80::DEC24r : Z80::DEC16r),
+            AddrOp.getReg()).addReg(AddrOp.getReg());
+  MIB.addReg(TRI->getSubReg(Reg, Z80::sub_low));
+  Reg = TRI->getSubReg(Reg, Z80::sub_high);
+  if (Overlap) {
+    TII->copyPhysReg(MBB, MI, DL, Z80::A, Reg, false);
+    Reg = Z80::A;
+  }
+  if (NewOpc == Z80::LD8pr)
+    BuildMI(MBB, MI, DL, TII->get(Is24Bit ? Z80::INC24r : Z80::INC16r),
+            AddrOp.getReg()).addReg(AddrOp.getReg());
+  MI.setDesc(TII->get(NewOpc));
+  SrcOp.setReg(Reg);
+  if (Index || Overlap)
+    BuildMI(MBB, Next, DL, TII->get(Is24Bit ? Z80::POP24r : Z80::POP16r),
+            ScratchReg);
+  Expand(*MIB);
+  Expand(MI);
+}
+
+/// Expand a load or store through a pointer that is stepped by the access
+/// size before or after the access.
+void Z80ExpandPseudo::ExpandPointerUpdate(MachineInstr &MI) {
+  MachineBasicBlock &MBB = *MI.getParent();
+  DebugLoc DL = MI.getDebugLoc();
+  bool IsLoad = MI.mayLoad();
+  unsigned Reg = MI.getOperand(IsLoad ? 0 : 2).getReg();
+  unsigned PtrReg = MI.getOperand(IsLoad ? 1 : 0).getReg();
+  bool KillSrc = !IsLoad && MI.getOperand(2).isKill();
+  int Amt = MI.getOperand(3).getImm();
+  bool PtrIs24Bit = Z80::A24RegClass.contains(PtrReg);
+  unsigned IncOpc = PtrIs24Bit ? Z80::INC24r : Z80::INC16r;
+  unsigned DecOpc = PtrIs24Bit ? Z80::DEC24r : Z80::DEC16r;
+  unsigned Size = TRI->getMinimalPhysRegClass(Reg)->getSize();
+  // The pseudo leaves the flags alone, which may be live across it, and INC
+  // and DEC of a register pair don't touch them either.
+  auto StepPtr = [&](unsigned Opc) {
+    MachineInstr *Step =
+        BuildMI(MBB, MI, DL, TII->get(Opc), PtrReg).addReg(PtrReg);
+    Step->RemoveOperand(Step->findRegisterDefOperandIdx(Z80::F));
+  };
+  SmallVector<std::pair<unsigned, unsigned>, 2> Parts;
+  if (Size == 2 && !STI->has16BitEZ80Ops() &&
+      !(!IsLoad && TRI->regsOverlap(Reg, PtrReg))) {
+    // Access a byte at a time, stepping the pointer in between.
+    Parts.push_back({ Z80::sub_low, 1 });
+    Parts.push_back({ Z80::sub_high, 1 });
+    if (Amt < 0)
+      std::reverse(Parts.begin(), Parts.end());
+  } else
+    Parts.push_back({ 0, Size });
+  for (auto &Part : Parts) {
+    unsigned PartReg = Part.first ? TRI->getSubReg(Reg, Part.first) : Reg;
+    for (unsigned I = 0; Amt < 0 && I != Part.second; ++I)
+      StepPtr(DecOpc);
+    unsigned AccessOpc;
+    switch (Part.second) {
+    default: llvm_unreachable("Unexpected access size");
+    case 1: AccessOpc = IsLoad ? Z80::LD8rp : Z80::LD8pr; break;
+    case 2:
+      if (STI->has16BitEZ80Ops())
+        AccessOpc = IsLoad ? Z80::LD16rp : Z80::LD16pr;
+      else
+        AccessOpc = IsLoad ? Z80::LD88rp : Z80::LD88pr;
+      break;
+    case 3: AccessOpc = IsLoad ? Z80::LD24rp : Z80::LD24pr; break;
+    }
+    MachineInstrBuilder MIB;
+    if (IsLoad)
+      MIB = BuildMI(MBB, MI, DL, TII->get(AccessOpc), PartReg).addReg(PtrReg);
+    else
+      MIB = BuildMI(MBB, MI, DL, TII->get(AccessOpc)).addReg(PtrReg)
+        .addReg(PartReg, getKillRegState(KillSrc && Parts.size() == 1));
+    Expand(*MIB);
+    for (unsigned I = 0; Amt > 0 && I != Part.second; ++I)
+      StepPtr(IncOpc);
+  }
+  MI.eraseFromParent();
+}
+
+/// Expand an instruction built while expanding another one, which may also
+/// be a pseudo that Z80InstrInfo rewrites in place.
+void Z80ExpandPseudo::Expand(MachineInstr &MI) {
+  if (!ExpandMI(MI) && MI.isPseudo())
+    TII->expandPostRAPseudo(MI);
+}
+
+bool Z80ExpandPseudo::ExpandMI(MachineInstr &MI) {
+  switch (MI.getOpcode()) {
+  default:
+    return false;
   case Z80::CP16ao:
   case Z80::CP24ao:
-    ExpandCmp(*MI, MBB);
+  case Z80::SUB16ao:
+  case Z80::SUB24ao:
+    ExpandCmp(MI);
     break;
   case Z80::CP16a0:
   case Z80::CP24a0:
-    ExpandCmp0(*MI, MBB);
+    ExpandCmp0(MI);
+    break;
+  case Z80::LD88rp:
+  case Z80::LD88ro:
+    ExpandLoadPair(MI);
+    break;
+  case Z80::LD88pr:
+  case Z80::LD88or:
+    ExpandStorePair(MI);
+    break;
+  case Z80::LD8rpu16:
+  case Z80::LD16rpu16:
+  case Z80::LD8rpu24:
+  case Z80::LD16rpu24:
+  case Z80::LD24rpu24:
+  case Z80::LD8pru16:
+  case Z80::LD16pru16:
+  case Z80::LD8pru24:
+  case Z80::LD16pru24:
+  case Z80::LD24pru24:
+    ExpandPointerUpdate(MI);
     break;
   }
-  return false;
-  MI = MBB.erase(MI);
+  ++NumExpanded;
   return true;
 }
 
 bool Z80ExpandPseudo::ExpandMBB(MachineBasicBlock &MBB) {
+  UseLEA = Is24Bit && !MBB.getParent()->getInfo<Z80MachineFunctionInfo>()
+                           ->shouldOptForSize(&MBB);
   bool Modified = false;
-  for (auto I = MBB.begin(), E = MBB.end(); I != E; ++I)
-    Modified |= ExpandMI(I, MBB);
+  // Expansions only insert around the current instruction, so advancing
+  // first keeps the iterator valid even when it is erased.
+  for (auto I = MBB.begin(), E = MBB.end(); I != E;)
+    Modified |= ExpandMI(*I++);
   return Modified;
 }
 
 bool Z80ExpandPseudo::runOnMachineFunction(MachineFunction &MF) {
-  getAnalysis<LiveIntervals>().addKillFlags(&getAnalysis<VirtRegMap>());
-  TII = MF.getSubtarget().getInstrInfo();
+  STI = &MF.getSubtarget<Z80Subtarget>();
+  TII = STI->getInstrInfo();
+  TRI = STI->getRegisterInfo();
+  Is24Bit = STI->is24Bit();
   bool Modified = false;
   for (auto &MBB : MF)
     Modified |= ExpandMBB(MBB);
@@ -21,20 +21,46 @@
 #include "llvm/CodeGen/MachineInstrBuilder.h"
 #include "llvm/CodeGen/MachineRegisterInfo.h"
 #include "llvm/CodeGen/RegisterScavenging.h"
+#include "llvm/Support/CommandLine.h"
 using namespace llvm;
 
+namespace {
+enum class ShadowRegsOwner { None, Generic, NMI };
+} // end anonymous namespace
+
+static cl::opt<ShadowRegsOwner> ShadowRegs(
+    "z80-shadow-regs",
+    cl::desc("Which interrupt handlers may save registers in the shadow set"),
+    cl::init(ShadowRegsOwner::Generic), cl::Hidden,
+    cl::values(clEnumValN(ShadowRegsOwner::None, "none",
+                          "Other code owns the shadow registers"),
+               clEnumValN(ShadowRegsOwner::Generic, "generic",
+                          "Reserved for non-nested maskable interrupts"),
+               clEnumValN(ShadowRegsOwner::NMI, "nmi",
+                          "Reserved for the non-maskable interrupt")));
+
 Z80FrameLowering::Z80FrameLowering(const Z80Subtarget &STI)
     : TargetFrameLowering(StackGrowsDown, 1, STI.is24Bit() ? -3 : -2),
       STI(STI), TII(*STI.getInstrInfo()), TRI(STI.getRegisterInfo()),
       Is24Bit(STI.is24Bit()), SlotSize(Is24Bit ? 3 : 2) {
 }
 
+/// Return true if MFI has any stack object that has not been removed, such as
+/// a spill slot that was turned into a push/pop pair.
+static bool hasLiveStackObjects(const MachineFrameInfo &MFI) {
+  for (int FI = MFI.getObjectIndexBegin(), E = MFI.getObjectIndexEnd();
+       FI != E; ++FI)
+    if (!MFI.isDeadObjectIndex(FI))
+      return true;
+  return false;
+}
+
 /// hasFP - Return true if the specified function should have a dedicated frame
-/// pointer register.  This is true if the function has variable sized allocas
-/// or if frame pointer elimination is disabled.
+/// pointer register.  This is true if the function has stack objects or if
+/// frame pointer elimination is disabled.
 bool Z80FrameLowering::hasFP(const MachineFunction &MF) const {
   return MF.getTarget().Options.DisableFramePointerElim(MF) ||
-    MF.getFrameInfo().hasStackObjects();
+    hasLiveStackObjects(MF.getFrameInfo());
 }
 
 void Z80FrameLowering::BuildStackAdjustment(MachineFunction &MF,
@@ -55,8 +81,7 @@ void Z80FrameLowering::BuildStackAdjustment(MachineFunction &MF,
     return;
   }
 
-  bool OptSize = MF.getFunction()->getAttributes()
-    .hasAttribute(AttributeList::FunctionIndex, Attribute::OptimizeForSize);
+  bool OptSize = MF.getInfo<Z80MachineFunctionInfo>()->shouldOptForSize(&MBB);
 
   // Optimal for small offsets
   //   POP/PUSH HL for every SlotSize bytes
@@ -137,8 +162,7 @@ void Z80FrameLowering::emitPrologue(MachineFunction &MF,
 
   int FPOffset = -1;
   if (hasFP(MF)) {
-    if (MF.getFunction()->getAttributes().hasAttribute(
-            AttributeList::FunctionIndex, Attribute::OptimizeForSize)) {
+    if (MF.getInfo<Z80MachineFunctionInfo>()->shouldOptForSize(&MBB)) {
       if (StackSize) {
         BuildMI(MBB, MI, DL, TII.get(Is24Bit ? Z80::LD24ri : Z80::LD16ri),
                 ScratchReg).addImm(StackSize);
@@ -228,10 +252,27 @@ void Z80FrameLowering::emitEpilogue(MachineFunction &MF,
             TRI->getFrameRegister(MF));
 }
 
-// Only non-nested non-nmi interrupts can use shadow registers.
+// The shadow registers are only free in one kind of interrupt handler, which
+// must not be able to interrupt itself.  Nested handlers never qualify, and
+// maskable handlers and the NMI handler can't both have them since an NMI can
+// arrive during a maskable one.
 static bool shouldUseShadow(const MachineFunction &MF) {
-  const Function &F = *MF.getFunction();
-  return F.getFnAttribute("interrupt").getValueAsString() == "Generic";
+  StringRef Kind =
+    MF.getFunction()->getFnAttribute("interrupt").getValueAsString();
+  switch (ShadowRegs) {
+  case ShadowRegsOwner::None:    return false;
+  case ShadowRegsOwner::Generic: return Kind == "Generic";
+  case ShadowRegsOwner::NMI:     return Kind == "NMI";
+  }
+  llvm_unreachable("Unknown shadow register owner");
+}
+
+/// Return true if Reg is saved by exchanging it with its shadow rather than
+/// by pushing it.  EXX and EX AF,AF' take 4 cycles each way against 21 for a
+/// push and pop, so this is done for every register with a shadow.
+static bool isShadowed(const MachineFunction &MF, unsigned Reg) {
+  return shouldUseShadow(MF) && !Z80::I24RegClass.contains(Reg) &&
+         !Z80::I16RegClass.contains(Reg);
 }
 
 void Z80FrameLowering::shadowCalleeSavedRegisters(
@@ -259,8 +300,11 @@ void Z80FrameLowering::shadowCalleeSavedRegisters(
 bool Z80FrameLowering::assignCalleeSavedSpillSlots(
     MachineFunction &MF, const TargetRegisterInfo *TRI,
     std::vector<CalleeSavedInfo> &CSI) const {
+  unsigned NumPushed = hasFP(MF);
+  for (const CalleeSavedInfo &Info : CSI)
+    NumPushed += !isShadowed(MF, Info.getReg());
   MF.getInfo<Z80MachineFunctionInfo>()
-    ->setCalleeSavedFrameSize((CSI.size() + hasFP(MF)) * SlotSize);
+    ->setCalleeSavedFrameSize(NumPushed * SlotSize);
   return true;
 }
 
@@ -279,8 +323,7 @@ bool Z80FrameLowering::spillCalleeSavedRegisters(
     unsigned Reg = CSI[i - 1].getReg();
 
     // Non-index registers can be spilled to shadow registers.
-    if (UseShadow && !Z80::I24RegClass.contains(Reg) &&
-                     !Z80::I16RegClass.contains(Reg))
+    if (isShadowed(MF, Reg))
       continue;
 
     bool isLiveIn = MRI.isLiveIn(Reg);
@@ -321,8 +364,7 @@ bool Z80FrameLowering::restoreCalleeSavedRegisters(
     unsigned Reg = CSI[i].getReg();
 
     // Non-index registers can be spilled to shadow registers.
-    if (UseShadow && !Z80::I24RegClass.contains(Reg) &&
-                     !Z80::I16RegClass.contains(Reg))
+    if (isShadowed(MF, Reg))
       continue;
 
     BuildMI(MBB, MI, DL, TII.get(Opc), Reg)
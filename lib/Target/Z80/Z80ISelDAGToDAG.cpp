@@ -13,9 +13,14 @@
 //===----------------------------------------------------------------------===//
 
 #include "Z80.h"
+#include "Z80MachineFunctionInfo.h"
 #include "Z80Subtarget.h"
 #include "Z80TargetMachine.h"
+#include "Z80TargetObjectFile.h"
+#include "llvm/Analysis/LazyBlockFrequencyInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
 #include "llvm/CodeGen/SelectionDAGISel.h"
+#include "llvm/IR/InlineAsm.h"
 using namespace llvm;
 
 #define DEBUG_TYPE "z80-isel"
@@ -42,20 +47,38 @@ namespace {
       return "Z80 DAG->DAG Instruction Selection";
     }
 
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.addRequired<ProfileSummaryInfoWrapperPass>();
+      AU.addRequired<LazyBlockFrequencyInfoPass>();
+      SelectionDAGISel::getAnalysisUsage(AU);
+    }
+
     bool runOnMachineFunction(MachineFunction &MF) override {
       // Reset the subtarget each time through.
       Subtarget = &MF.getSubtarget<Z80Subtarget>();
-      return SelectionDAGISel::runOnMachineFunction(MF);
+      // Let lowering see which block it is in, so that size and speed can be
+      // traded off per block.
+      auto *Z80FI = MF.getInfo<Z80MachineFunctionInfo>();
+      computeBlockOptForSize(MF, *Z80FI);
+      Z80FI->setLoweringInfo(FuncInfo.get());
+      bool Changed = SelectionDAGISel::runOnMachineFunction(MF);
+      Z80FI->setLoweringInfo(nullptr);
+      return Changed;
     }
 
 // Include the pieces autogenerated from the target description.
 #include "Z80GenDAGISel.inc"
 
   private:
+    void computeBlockOptForSize(MachineFunction &MF,
+                                Z80MachineFunctionInfo &Z80FI);
+    void PreprocessISelDAG() override;
     void Select(SDNode *N) override;
+    bool tryIndexedLoadStore(SDNode *N);
+    const GlobalAddressSDNode *getSmallDataAddress(SDValue N) const;
 
     bool SelectMem(SDValue N, SDValue &Mem);
-    bool SelectOff(SDValue N, SDValue &Reg, SDValue &Off);
+    bool SelectOff(SDNode *Parent, SDValue N, SDValue &Reg, SDValue &Off);
 
     /// Implement addressing mode selection for inline asm expressions.
     bool SelectInlineAsmMemoryOperand(const SDValue &Op, unsigned ConstraintID,
@@ -63,6 +86,73 @@ namespace {
   };
 }
 
+/// Use the profile, if there is one, to decide which blocks deviate from the
+/// function's size/speed preference.  Cold code is kept compact even in
+/// functions optimized for speed, and hot code is inlined even in functions
+/// optimized for size.
+void Z80DAGToDAGISel::computeBlockOptForSize(MachineFunction &MF,
+                                             Z80MachineFunctionInfo &Z80FI) {
+  if (OptLevel == CodeGenOpt::None)
+    return;
+  ProfileSummaryInfo *PSI =
+    getAnalysis<ProfileSummaryInfoWrapperPass>().getPSI();
+  if (!PSI->hasProfileSummary())
+    return;
+  BlockFrequencyInfo &BFI = getAnalysis<LazyBlockFrequencyInfoPass>().getBFI();
+  for (const BasicBlock &BB : *MF.getFunction()) {
+    if (PSI->isHotBB(&BB, &BFI))
+      Z80FI.setBlockOptForSize(&BB, false);
+    else if (PSI->isColdBB(&BB, &BFI))
+      Z80FI.setBlockOptForSize(&BB, true);
+  }
+}
+
+void Z80DAGToDAGISel::PreprocessISelDAG() {
+  // Fields beyond the reach of an 8-bit displacement would each need their own
+  // address computation.  Rebase them onto the base pointer plus a multiple of
+  // 256, or of 128 when the whole access wouldn't fit otherwise, which is
+  // shared by nearby fields, so that they can all be accessed through one
+  // index register.
+  bool Changed = false;
+  for (SelectionDAG::allnodes_iterator I = CurDAG->allnodes_begin(),
+         E = CurDAG->allnodes_end(); I != E; ) {
+    SDNode *N = &*I++;
+    auto *Mem = dyn_cast<LSBaseSDNode>(N);
+    if (!Mem || !Mem->isUnindexed())
+      continue;
+    SDValue Ptr = Mem->getBasePtr();
+    if (Ptr.getOpcode() != ISD::ADD)
+      continue;
+    SDValue Base = Ptr.getOperand(0);
+    auto *C = dyn_cast<ConstantSDNode>(Ptr.getOperand(1));
+    if (!C || Base.hasOneUse() || Base.getOpcode() == ISD::FrameIndex ||
+        Base.getOpcode() == Z80ISD::Wrapper)
+      continue;
+    // As in SelectOff, a multibyte access is split into byte accesses, and
+    // the displacement of the last byte has to be in range too.
+    int64_t Span = Subtarget->hasEZ80Ops() ? 1
+                                           : Mem->getMemoryVT().getStoreSize();
+    int64_t Val = C->getSExtValue();
+    if (isInt<8>(Val) && isInt<8>(Val + Span - 1))
+      continue;
+    int64_t Rebase = (Val + 128) & ~int64_t(0xFF);
+    if (!isInt<8>(Val - Rebase + Span - 1))
+      Rebase += 128;
+    SDLoc DL(Ptr);
+    EVT VT = Ptr.getValueType();
+    SDValue NewBase = CurDAG->getNode(ISD::ADD, DL, VT, Base,
+                                      CurDAG->getConstant(Rebase, DL, VT));
+    SDValue NewPtr = CurDAG->getNode(ISD::ADD, DL, VT, NewBase,
+                                     CurDAG->getConstant(Val - Rebase, DL, VT));
+    DEBUG(dbgs() << "Rebasing: "; Ptr.dump(CurDAG); dbgs() << "as: ";
+          NewPtr.dump(CurDAG));
+    CurDAG->ReplaceAllUsesOfValueWith(Ptr, NewPtr);
+    Changed = true;
+  }
+  if (Changed)
+    CurDAG->RemoveDeadNodes();
+}
+
 void Z80DAGToDAGISel::Select(SDNode *Node) {
   SDLoc DL(Node);
 
@@ -76,11 +166,87 @@ void Z80DAGToDAGISel::Select(SDNode *Node) {
     return;
   }
 
+  switch (Node->getOpcode()) {
+  default: break;
+  case ISD::LOAD:
+  case ISD::STORE:
+    if (tryIndexedLoadStore(Node))
+      return;
+    break;
+  }
+
   // Select the default instruction
   SelectCode(Node);
 }
 
+/// Select a pre-decrement or post-increment load or store as a pseudo that
+/// updates the pointer register in place.
+bool Z80DAGToDAGISel::tryIndexedLoadStore(SDNode *N) {
+  auto *Mem = cast<LSBaseSDNode>(N);
+  if (Mem->isUnindexed())
+    return false;
+  bool IsLoad = isa<LoadSDNode>(Mem);
+  bool Is24Bit = Subtarget->is24Bit();
+  int64_t Amt = cast<ConstantSDNode>(Mem->getOffset())->getSExtValue();
+  if (Mem->getAddressingMode() == ISD::PRE_DEC)
+    Amt = -Amt;
+  unsigned Opc;
+  switch (Mem->getMemoryVT().getSimpleVT().SimpleTy) {
+  default: return false;
+  case MVT::i8:
+    Opc = IsLoad ? Is24Bit ? Z80::LD8rpu24 : Z80::LD8rpu16
+                 : Is24Bit ? Z80::LD8pru24 : Z80::LD8pru16;
+    break;
+  case MVT::i16:
+    Opc = IsLoad ? Is24Bit ? Z80::LD16rpu24 : Z80::LD16rpu16
+                 : Is24Bit ? Z80::LD16pru24 : Z80::LD16pru16;
+    break;
+  case MVT::i24:
+    Opc = IsLoad ? Z80::LD24rpu24 : Z80::LD24pru24;
+    break;
+  }
+  SDLoc DL(N);
+  MVT PtrVT = TLI->getPointerTy(CurDAG->getDataLayout());
+  SDValue AmtOp = CurDAG->getTargetConstant(Amt, DL, MVT::i8);
+  MachineSDNode *Res;
+  if (IsLoad)
+    Res = CurDAG->getMachineNode(Opc, DL, N->getValueType(0), PtrVT,
+                                 MVT::Other, Mem->getBasePtr(), AmtOp,
+                                 Mem->getChain());
+  else
+    Res = CurDAG->getMachineNode(Opc, DL, PtrVT, MVT::Other,
+                                 Mem->getBasePtr(),
+                                 cast<StoreSDNode>(Mem)->getValue(), AmtOp,
+                                 Mem->getChain());
+  MachineSDNode::mmo_iterator MemOp = MF->allocateMemRefsArray(1);
+  MemOp[0] = Mem->getMemOperand();
+  Res->setMemRefs(MemOp, MemOp + 1);
+  ReplaceNode(N, Res);
+  return true;
+}
+
+/// Return true if Reg will end up in an index register anyway, either because
+/// it comes from one or because it is also used as the base of a memory access.
+/// Only then is LEA or PEA cheaper than a separate add.
+static bool isIndexBase(SDValue Reg) {
+  if (Reg.getOpcode() == ISD::CopyFromReg) {
+    unsigned PhysReg = cast<RegisterSDNode>(Reg.getOperand(1))->getReg();
+    if (TargetRegisterInfo::isPhysicalRegister(PhysReg))
+      return Z80::I16RegClass.contains(PhysReg) ||
+             Z80::I24RegClass.contains(PhysReg);
+  }
+  for (SDNode::use_iterator I = Reg->use_begin(), E = Reg->use_end(); I != E;
+       ++I)
+    if (auto *Mem = dyn_cast<LSBaseSDNode>(*I))
+      if (I.getUse().get() == Reg && Mem->getBasePtr() == Reg)
+        return true;
+  return false;
+}
+
 bool Z80DAGToDAGISel::SelectMem(SDValue N, SDValue &Mem) {
+  // Short pointers are only accessed through a register.
+  if (N.getValueType() != TLI->getPointerTy(CurDAG->getDataLayout()))
+    return false;
   switch (N.getOpcode()) {
   default:
     DEBUG(dbgs() << "SelectMem: " << N->getOperationName() << '\n');
@@ -91,29 +257,69 @@ bool Z80DAGToDAGISel::SelectMem(SDValue N, SDValue &Mem) {
     return true;
   }
   case Z80ISD::Wrapper: {
+    // Leave small data to SelectOff, which addresses it through IY.
+    if (getSmallDataAddress(N))
+      return false;
     Mem = N->getOperand(0);
     return true;
   }
   }
 }
-bool Z80DAGToDAGISel::SelectOff(SDValue N, SDValue &Reg, SDValue &Off) {
+
+/// Return the global address wrapped by N if it lives in the small data area.
+const GlobalAddressSDNode *
+Z80DAGToDAGISel::getSmallDataAddress(SDValue N) const {
+  if (N.getOpcode() != Z80ISD::Wrapper)
+    return nullptr;
+  auto *GA = dyn_cast<GlobalAddressSDNode>(N.getOperand(0));
+  if (!GA)
+    return nullptr;
+  auto *GO = dyn_cast<GlobalObject>(GA->getGlobal());
+  const auto &TLOF =
+    static_cast<const Z80TargetObjectFile &>(*TM.getObjFileLowering());
+  if (!GO || !TLOF.isGlobalInSmallSection(GO, TM))
+    return nullptr;
+  return GA;
+}
+bool Z80DAGToDAGISel::SelectOff(SDNode *Parent, SDValue N, SDValue &Reg,
+                                SDValue &Off) {
+  if (N.getValueType() != TLI->getPointerTy(CurDAG->getDataLayout()))
+    return false;
+  // Without eZ80 ops, multibyte accesses are split into byte accesses at
+  // consecutive displacements, all of which have to be in range.
+  unsigned Span = 1;
+  if (auto *Mem = dyn_cast_or_null<MemSDNode>(Parent))
+    if (!Subtarget->hasEZ80Ops())
+      Span = Mem->getMemoryVT().getStoreSize();
   switch (N.getOpcode()) {
   default: return false;
   case ISD::ADD:
+  case ISD::SUB:
     for (int I = 0; I != 2; ++I) {
       if (ConstantSDNode *C = dyn_cast<ConstantSDNode>(N.getOperand(I))) {
         int64_t Val = C->getSExtValue();
-        if (!isInt<8>(Val))
+        if (N.getOpcode() == ISD::SUB) {
+          if (I != 1)
+            continue;
+          Val = -Val;
+        }
+        if (!isInt<8>(Val) || !isInt<8>(Val + Span - 1))
           continue;
         Reg = N.getOperand(1 - I);
         FrameIndexSDNode *Idx = dyn_cast<FrameIndexSDNode>(Reg);
         if (Val >= -1 && Val <= 1 && !Idx && Reg.hasOneUse())
           continue;
+        // Computing an address with LEA or PEA needs the base in an index
+        // register, so only do it for frame addresses and values that are
+        // already there.
+        if ((!Parent || Parent->getOpcode() == Z80ISD::PUSH) && !Idx &&
+            !isIndexBase(Reg))
+          continue;
         if (Idx)
           Reg = CurDAG->getTargetFrameIndex(
               Idx->getIndex(), TLI->getPointerTy(CurDAG->getDataLayout()));
         Off = CurDAG->getTargetConstant(Val, SDLoc(N), MVT::i8);
-        DEBUG(dbgs() << "Selected ADD:\n";
+        DEBUG(dbgs() << "Selected " << N->getOperationName() << ":\n";
               N.dumpr();
               dbgs() << "becomes\n";
               Reg.dumpr();
@@ -128,13 +334,50 @@ bool Z80DAGToDAGISel::SelectOff(SDValue N, SDValue &Reg, SDValue &Off) {
         TLI->getPointerTy(CurDAG->getDataLayout()));
     Off = CurDAG->getTargetConstant(0, SDLoc(N), MVT::i8);
     return true;
+  case Z80ISD::Wrapper: {
+    // Loads and stores of small data become (iy + sym - base), the linker
+    // keeps the section within reach of the displacement.
+    const GlobalAddressSDNode *GA = getSmallDataAddress(N);
+    if (!GA || !Parent || !isa<MemSDNode>(Parent) ||
+        Parent->getOpcode() == Z80ISD::PUSH)
+      return false;
+    Reg = CurDAG->getRegister(Subtarget->is24Bit() ? Z80::UIY : Z80::IY,
+                              N.getValueType());
+    Off = CurDAG->getTargetGlobalAddress(GA->getGlobal(), SDLoc(N), MVT::i8,
+                                         GA->getOffset(), Z80II::MO_SDATA);
+    return true;
+  }
   }
 }
 
 bool Z80DAGToDAGISel::
 SelectInlineAsmMemoryOperand(const SDValue &Op, unsigned ConstraintID,
                              std::vector<SDValue> &OutOps) {
-  llvm_unreachable("Unimplemented");
+  SDValue Reg, Off;
+  switch (ConstraintID) {
+  default:
+    return true;
+  case InlineAsm::Constraint_m:
+    // Only frame objects are known to end up based on an index register, so
+    // anything else is passed as a plain pointer register, which has to be one
+    // that (rr) accepts.  A frame object that turns out to be out of (ix + d)
+    // range is moved into a register by eliminateFrameIndex.
+    if (!SelectOff(nullptr, Op, Reg, Off) ||
+        Reg.getOpcode() != ISD::TargetFrameIndex) {
+      SDLoc DL(Op);
+      const TargetRegisterClass *RC =
+          Subtarget->getRegisterInfo()->getPointerRegClass(*MF, 1);
+      Reg = SDValue(CurDAG->getMachineNode(
+                        TargetOpcode::COPY_TO_REGCLASS, DL, Op.getValueType(),
+                        Op, CurDAG->getTargetConstant(RC->getID(), DL,
+                                                      MVT::i32)), 0);
+      Off = CurDAG->getTargetConstant(0, DL, MVT::i8);
+    }
+    break;
+  }
+  OutOps.push_back(Reg);
+  OutOps.push_back(Off);
+  return false;
 }
 
 /// This pass converts a legalized DAG into Z80-specific DAG,
@@ -17,9 +17,13 @@
 #include "Z80MachineFunctionInfo.h"
 #include "Z80Subtarget.h"
 #include "Z80TargetMachine.h"
+#include "Z80TargetObjectFile.h"
 #include "llvm/CodeGen/MachineInstrBuilder.h"
 #include "llvm/CodeGen/MachineRegisterInfo.h"
 #include "llvm/CodeGen/SelectionDAG.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/LLVMContext.h"
 using namespace llvm;
 
 #define DEBUG_TYPE "z80-isel"
@@ -84,11 +88,42 @@ Z80TargetLowering::Z80TargetLowering(const Z80TargetMachine &TM,
     //setOperationAction(ISD::STORE, MVT::i16, Custom);
   //if (Is24Bit)
     //setLoadExtAction(ISD::EXTLOAD, MVT::i24, MVT::i16, Legal);
+  // Walking a pointer by the access size is done with INC/DEC of the pointer.
+  for (MVT VT : { MVT::i8, MVT::i16, MVT::i24 }) {
+    if (VT == MVT::i24 && !Is24Bit)
+      continue;
+    for (unsigned AM : { ISD::POST_INC, ISD::PRE_DEC }) {
+      setIndexedLoadAction(AM, VT, Legal);
+      setIndexedStoreAction(AM, VT, Legal);
+    }
+  }
+  // Short pointers are converted through MBASE.
+  if (Is24Bit)
+    for (MVT VT : { MVT::i16, MVT::i24 })
+      setOperationAction(ISD::ADDRSPACECAST, VT, Custom);
   setOperationAction(ISD::DYNAMIC_STACKALLOC, PtrVT, Expand);
   for (unsigned Opc : { ISD::GlobalAddress, ISD::ExternalSymbol,
                         ISD::BlockAddress })
     setOperationAction(Opc, PtrVT, Custom);
 
+  // i64 operations are done in memory by the runtime.
+  for (unsigned Opc : { ISD::ADD,  ISD::SUB,  ISD::MUL,
+                        ISD::SDIV, ISD::UDIV, ISD::SREM, ISD::UREM,
+                        ISD::SHL,  ISD::SRA,  ISD::SRL,
+                        ISD::SETCC, ISD::BR_CC, ISD::SELECT_CC })
+    setOperationAction(Opc, MVT::i64, Custom);
+
+  // Floats are softened, but anything that only looks at the sign is done on
+  // the integer bits instead of calling the runtime.
+  for (MVT VT : { MVT::f32, MVT::f64 })
+    for (unsigned Opc : { ISD::FNEG, ISD::FABS,
+                          ISD::SETCC, ISD::BR_CC, ISD::SELECT_CC })
+      setOperationAction(Opc, VT, Custom);
+
+  for (unsigned Opc : { ISD::INTRINSIC_WO_CHAIN, ISD::INTRINSIC_W_CHAIN,
+                        ISD::INTRINSIC_VOID })
+    setOperationAction(Opc, MVT::Other, Custom);
+
   setOperationAction(ISD::VASTART, MVT::Other, Custom);
   setOperationAction(ISD::VAARG,   MVT::Other, Expand);
   setOperationAction(ISD::VAEND,   MVT::Other, Expand);
@@ -98,11 +133,13 @@ Z80TargetLowering::Z80TargetLowering(const Z80TargetMachine &TM,
 
   setTargetDAGCombine(ISD::MUL);
   setTargetDAGCombine(ISD::TRUNCATE);
+  setTargetDAGCombine(ISD::LOAD);
+  setTargetDAGCombine(ISD::STORE);
 
   // Compute derived properties from the register classes
   computeRegisterProperties(STI.getRegisterInfo());
 
-  setBooleanContents(UndefinedBooleanContent);
+  setBooleanContents(ZeroOrOneBooleanContent);
 
   {
     using namespace RTLIB;
@@ -181,6 +218,22 @@ Z80TargetLowering::Z80TargetLowering(const Z80TargetMachine &TM,
       { UREM_I32,         "_lremu",    Z80_LibCall },
       { UDIVREM_I24,      "_idvrmu",   Z80_LibCall },
       { UDIVREM_I32,      "_ldvrmu",   Z80_LibCall },
+      // i64 helpers work in place: the first argument points to the left
+      // operand and receives the result, the second points to the right
+      // operand, or is the amount for shifts.
+      { ADD_I64,          "_lladd",    Z80_LibCall },
+      { SUB_I64,          "_llsub",    Z80_LibCall },
+      { MUL_I64,          "_llmulu",   Z80_LibCall },
+      { SDIV_I64,         "_lldivs",   Z80_LibCall },
+      { UDIV_I64,         "_lldivu",   Z80_LibCall },
+      { SREM_I64,         "_llrems",   Z80_LibCall },
+      { UREM_I64,         "_llremu",   Z80_LibCall },
+      { SHL_I64,          "_llshl",    Z80_LibCall },
+      { SRA_I64,          "_llshrs",   Z80_LibCall },
+      { SRL_I64,          "_llshru",   Z80_LibCall },
+      // Return 0, 1 or 2 in A for less, equal or greater.
+      { CMP_I64,          "_llcmpu",   Z80_LibCall },
+      { SCMP_I64,         "_llcmps",   Z80_LibCall },
       // Floats
       { ADD_F32,          "_fadd",     Z80_LibCall_L },
       { SUB_F32,          "_fsub",     Z80_LibCall_L },
@@ -190,6 +243,38 @@ Z80TargetLowering::Z80TargetLowering(const Z80TargetMachine &TM,
       { FPTOUINT_F32_I32, "_ftol",     Z80_LibCall_L }, // Hmm
       { SINTTOFP_I32_F32, "_ltof",     Z80_LibCall_L },
       { UINTTOFP_I32_F32, "_ultof",    Z80_LibCall_L },
+      // Helpers that aren't in the original runtime pass both operands in
+      // registers.
+      { REM_F32,          "_frem",     Z80_LibCall },
+      // Comparisons return a value that is tested against zero, as in libgcc.
+      { OEQ_F32,          "_feq",      Z80_LibCall },
+      { UNE_F32,          "_fne",      Z80_LibCall },
+      { OGE_F32,          "_fge",      Z80_LibCall },
+      { OLT_F32,          "_flt",      Z80_LibCall },
+      { OLE_F32,          "_fle",      Z80_LibCall },
+      { OGT_F32,          "_fgt",      Z80_LibCall },
+      { UO_F32,           "_funord",   Z80_LibCall },
+      { O_F32,            "_funord",   Z80_LibCall },
+      // Doubles don't fit in registers, so these keep the C convention.
+      { ADD_F64,          "_dadd",     C },
+      { SUB_F64,          "_dsub",     C },
+      { MUL_F64,          "_dmul",     C },
+      { DIV_F64,          "_ddiv",     C },
+      { REM_F64,          "_drem",     C },
+      { FPEXT_F32_F64,    "_ftod",     C },
+      { FPROUND_F64_F32,  "_dtof",     C },
+      { FPTOSINT_F64_I32, "_dtol",     C },
+      { FPTOUINT_F64_I32, "_dtoul",    C },
+      { SINTTOFP_I32_F64, "_ltod",     C },
+      { UINTTOFP_I32_F64, "_ultod",    C },
+      { OEQ_F64,          "_deq",      C },
+      { UNE_F64,          "_dne",      C },
+      { OGE_F64,          "_dge",      C },
+      { OLT_F64,          "_dlt",      C },
+      { OLE_F64,          "_dle",      C },
+      { OGT_F64,          "_dgt",      C },
+      { UO_F64,           "_dunord",   C },
+      { O_F64,            "_dunord",   C },
     };
 
     for (const auto &LC : LibraryCalls) {
@@ -262,24 +347,129 @@ SDValue Z80TargetLowering::EmitSignToCarry(SDValue Op,
     .getValue(1);
 }
 
+/// Return true if a select between TV and FV is cheaper done by masking with
+/// the all ones or zero value that SBC A,A materializes from carry than by
+/// branching.
+static bool isCarrySelectCheap(EVT VT, SDValue TV, SDValue FV) {
+  auto *ConstTV = dyn_cast<ConstantSDNode>(TV);
+  auto *ConstFV = dyn_cast<ConstantSDNode>(FV);
+  if (ConstTV && ConstFV) {
+    if (VT == MVT::i8)
+      return true;
+    const APInt &T = ConstTV->getAPIntValue(), &F = ConstFV->getAPIntValue();
+    if (T.isAllOnesValue() && F == 0)
+      return true;
+    return (T.isIntN(8) && F.isIntN(8)) ||
+      (T.isSignedIntN(8) && F.isSignedIntN(8));
+  }
+  return VT == MVT::i8 && (isNullConstant(TV) || isNullConstant(FV));
+}
+
+/// Select TV if carry is set, otherwise FV, without branching.
+SDValue Z80TargetLowering::EmitCarrySelect(const SDLoc &DL, EVT VT, SDValue TV,
+                                           SDValue FV, SDValue Flags,
+                                           SelectionDAG &DAG) const {
+  auto *ConstTV = dyn_cast<ConstantSDNode>(TV);
+  auto *ConstFV = dyn_cast<ConstantSDNode>(FV);
+  if (VT != MVT::i8) {
+    const APInt &T = ConstTV->getAPIntValue(), &F = ConstFV->getAPIntValue();
+    if (T.isAllOnesValue() && F == 0)
+      return DAG.getNode(Z80ISD::SEXT, DL, VT, Flags);
+    // Select the low byte and extend it.
+    unsigned ExtOpc = T.isIntN(8) && F.isIntN(8) ? ISD::ZERO_EXTEND
+                                                 : ISD::SIGN_EXTEND;
+    SDValue Res = EmitCarrySelect(
+        DL, MVT::i8, DAG.getConstant(T.trunc(8), DL, MVT::i8),
+        DAG.getConstant(F.trunc(8), DL, MVT::i8), Flags, DAG);
+    return DAG.getNode(ExtOpc, DL, VT, Res);
+  }
+  SDValue Mask = DAG.getNode(Z80ISD::SEXT, DL, VT, Flags);
+  if (ConstTV && ConstFV) {
+    // (Mask & (TV ^ FV)) ^ FV
+    uint8_t T = ConstTV->getZExtValue(), F = ConstFV->getZExtValue();
+    SDValue Res = Mask;
+    if (uint8_t(T ^ F) != 0xFF)
+      Res = DAG.getNode(ISD::AND, DL, VT, Res,
+                        DAG.getConstant(T ^ F, DL, VT));
+    if (F)
+      Res = DAG.getNode(ISD::XOR, DL, VT, Res, DAG.getConstant(F, DL, VT));
+    return Res;
+  }
+  if (isNullConstant(FV))
+    return DAG.getNode(ISD::AND, DL, VT, Mask, TV);
+  assert(isNullConstant(TV) && "Expected a zero operand");
+  return DAG.getNode(ISD::AND, DL, VT, DAG.getNOT(DL, Mask, VT), FV);
+}
+
+/// Extend a 16-bit MBASE-relative pointer to a 24-bit pointer.  The upper byte
+/// of a register can't be written directly, so the pointer is assembled in a
+/// stack temporary.
+SDValue Z80TargetLowering::EmitMBaseExtend(const SDLoc &DL, SDValue Ptr,
+                                           SelectionDAG &DAG) const {
+  assert(Subtarget.is24Bit() && Ptr.getValueType() == MVT::i16 &&
+         "Expected a short pointer");
+  MachineFunction &MF = DAG.getMachineFunction();
+  SDValue Slot = DAG.CreateStackTemporary(MVT::i24);
+  int FI = cast<FrameIndexSDNode>(Slot)->getIndex();
+  MachinePointerInfo MPI = MachinePointerInfo::getFixedStack(MF, FI);
+  SDValue Ch = DAG.getEntryNode();
+  SDValue Lo = DAG.getStore(Ch, DL, Ptr, Slot, MPI);
+  SDValue Hi = DAG.getStore(Ch, DL, DAG.getNode(Z80ISD::MBASE, DL, MVT::i8),
+                            DAG.getMemBasePlusOffset(Slot, 2, DL),
+                            MPI.getWithOffset(2));
+  Ch = DAG.getNode(ISD::TokenFactor, DL, MVT::Other, Lo, Hi);
+  return DAG.getLoad(MVT::i24, DL, Ch, Slot, MPI);
+}
+
 // Legalize Types Helpers
 
 void Z80TargetLowering::ReplaceNodeResults(SDNode *N,
                                            SmallVectorImpl<SDValue> &Results,
                                            SelectionDAG &DAG) const {
   DEBUG(dbgs() << "ReplaceNodeResults: "; N->dump(&DAG));
+  switch (N->getOpcode()) {
+  case ISD::SHL:
+  case ISD::SRA:
+  case ISD::SRL:
+    if (SDValue Res = ExpandShift32(N, DAG))
+      Results.push_back(Res);
+    else if (SDValue Res = ExpandI64(N, DAG))
+      Results.push_back(Res);
+    break;
+  case ISD::ADD:
+  case ISD::SUB:
+  case ISD::MUL:
+  case ISD::SDIV:
+  case ISD::UDIV:
+  case ISD::SREM:
+  case ISD::UREM:
+    if (SDValue Res = ExpandI64(N, DAG))
+      Results.push_back(Res);
+    break;
+  case ISD::FNEG:
+  case ISD::FABS:
+    Results.push_back(ExpandFPSign(N, DAG));
+    break;
+  }
 }
 
 // Legalize Helpers
 
+/// Return true if the block being selected should be optimized for size.  This
+/// follows the profile where there is one, so that cold code in a fast
+/// function still gets the compact forms and vice versa.
+static bool shouldOptForSize(const SelectionDAG &DAG) {
+  return DAG.getMachineFunction().getInfo<Z80MachineFunctionInfo>()
+    ->shouldOptForSize();
+}
+
 SDValue Z80TargetLowering::LowerAddSub(SDValue Op, SelectionDAG &DAG) const {
   SDLoc DL(Op);
   unsigned Opc = Op.getOpcode();
   EVT VT = Op.getValueType();
   SDValue LHS = Op.getOperand(0), RHS = Op.getOperand(1);
   ConstantSDNode *ConstLHS = dyn_cast<ConstantSDNode>(LHS);
-  bool OptSize = DAG.getMachineFunction().getFunction()->getAttributes()
-    .hasAttribute(AttributeList::FunctionIndex, Attribute::OptimizeForSize);
+  bool OptSize = shouldOptForSize(DAG);
   if (OptSize && Opc == ISD::SUB && VT.bitsGT(MVT::i8) && ConstLHS &&
       !ConstLHS->getZExtValue())
     return LowerLibCall(RTLIB::UNKNOWN_LIBCALL, RTLIB::NEG_I16, RTLIB::NEG_I24,
@@ -295,8 +485,7 @@ SDValue Z80TargetLowering::LowerBitwise(SDValue Op, SelectionDAG &DAG) const {
   EVT VT = Op.getValueType();
   SDValue LHS = Op.getOperand(0), RHS = Op.getOperand(1);
   ConstantSDNode *ConstRHS = dyn_cast<ConstantSDNode>(RHS);
-  bool OptSize = DAG.getMachineFunction().getFunction()->getAttributes()
-    .hasAttribute(AttributeList::FunctionIndex, Attribute::OptimizeForSize);
+  bool OptSize = shouldOptForSize(DAG);
   if (OptSize && Opc == ISD::XOR && VT.bitsGT(MVT::i8) && ConstRHS &&
       ConstRHS->getSExtValue() == ~0)
     return LowerLibCall(RTLIB::UNKNOWN_LIBCALL, RTLIB::NOT_I16, RTLIB::NOT_I24,
@@ -331,8 +520,7 @@ SDValue Z80TargetLowering::LowerShift(SDValue Op, SelectionDAG &DAG) const {
   assert((VT == MVT::i8 || (Opc != ISD::ROTL && Opc != ISD::ROTR)) &&
          "Unsupported operation!");
   bool Is24Bit = Subtarget.is24Bit();
-  bool OptSize = DAG.getMachineFunction().getFunction()->getAttributes()
-    .hasAttribute(AttributeList::FunctionIndex, Attribute::OptimizeForSize);
+  bool OptSize = shouldOptForSize(DAG);
   if (ConstantSDNode *Shift = dyn_cast<ConstantSDNode>(Op.getOperand(1))) {
     unsigned Amt = Shift->getZExtValue();
     SDValue Val = Op->getOperand(0);
@@ -425,6 +613,303 @@ SDValue Z80TargetLowering::LowerShift(SDValue Op, SelectionDAG &DAG) const {
   return SDValue();
 }
 
+/// Expand an i32 shift by a constant into operations on its four bytes.  Whole
+/// bytes are moved between registers, with zero or sign fill, and the rest is
+/// done one bit at a time, using ADD HL,HL for the low pair of a left shift and
+/// rotating the carry through the other bytes.  When optimizing for size, the
+/// library call is used if it is smaller.
+SDValue Z80TargetLowering::ExpandShift32(SDNode *N, SelectionDAG &DAG) const {
+  SDLoc DL(N);
+  unsigned Opc = N->getOpcode();
+  SDValue Val = N->getOperand(0);
+  auto *Shift = dyn_cast<ConstantSDNode>(N->getOperand(1));
+  if (N->getValueType(0) != MVT::i32 || !Shift)
+    return SDValue();
+  unsigned Amt = Shift->getZExtValue();
+  if (!Amt || Amt >= 32)
+    return SDValue();
+  unsigned Bytes = Amt / 8, Bits = Amt % 8, Live = 4 - Bytes;
+  bool Is24Bit = Subtarget.is24Bit();
+  bool OptSize = shouldOptForSize(DAG);
+  bool SignFill = Opc == ISD::SRA && Amt == 31;
+  if (OptSize && !SignFill) {
+    // A call costs loading the amount and the call itself.  Inline, each bit
+    // costs a two byte rotate per live byte, less for the ADD HL,HL pair.
+    unsigned PerBit = 2 * Live;
+    if (Opc == ISD::SHL && Live >= 2)
+      PerBit -= 3;
+    unsigned InlineSize = Bits * PerBit + (Bytes ? Live + 2 : 0);
+    if (InlineSize > 5 + Is24Bit) {
+      RTLIB::Libcall LC = Opc == ISD::SHL ? RTLIB::SHL_I32 :
+                          Opc == ISD::SRA ? RTLIB::SRA_I32 : RTLIB::SRL_I32;
+      SDValue Ops[] = { Val, N->getOperand(1) };
+      return makeLibCall(DAG, LC, MVT::i32, Ops, Opc == ISD::SRA, DL).first;
+    }
+  }
+
+  SDValue Halves[2];
+  for (unsigned I = 0; I != 2; ++I)
+    Halves[I] = DAG.getNode(ISD::EXTRACT_ELEMENT, DL, MVT::i16, Val,
+                            DAG.getIntPtrConstant(I, DL));
+  SDValue In[4], Out[4];
+  for (unsigned I = 0; I != 4; ++I)
+    In[I] = DAG.getTargetExtractSubreg(I & 1 ? Z80::sub_high : Z80::sub_low,
+                                       DL, MVT::i8, Halves[I >> 1]);
+  SDValue Fill = DAG.getConstant(0, DL, MVT::i8);
+  if (Opc == ISD::SRA)
+    Fill = DAG.getNode(Z80ISD::SEXT, DL, MVT::i8, EmitSignToCarry(In[3], DAG));
+  if (SignFill)
+    return DAG.getNode(ISD::BUILD_PAIR, DL, MVT::i32,
+                       EmitPair(DL, Fill, Fill, DAG),
+                       EmitPair(DL, Fill, Fill, DAG));
+  for (unsigned I = 0; I != 4; ++I)
+    if (Opc == ISD::SHL)
+      Out[I] = I >= Bytes ? In[I - Bytes] : Fill;
+    else
+      Out[I] = I < Live ? In[I + Bytes] : Fill;
+
+  SDVTList VTList = DAG.getVTList(MVT::i8, MVT::i8);
+  if (Opc == ISD::SHL) {
+    // The low live pair is shifted with ADD, the carry rotated into the rest.
+    if (Live >= 2) {
+      SDValue Pair = EmitPair(DL, Out[Bytes + 1], Out[Bytes], DAG);
+      for (unsigned Bit = 0; Bit != Bits; ++Bit) {
+        Pair = DAG.getNode(Z80ISD::ADD, DL, DAG.getVTList(MVT::i16, MVT::i8),
+                           Pair, Pair);
+        SDValue Carry = Pair.getValue(1);
+        for (unsigned I = Bytes + 2; I != 4; ++I) {
+          Out[I] = DAG.getNode(Z80ISD::RL, DL, VTList, Out[I], Carry);
+          Carry = Out[I].getValue(1);
+        }
+      }
+      if (Bits) {
+        Out[Bytes] = DAG.getTargetExtractSubreg(Z80::sub_low, DL, MVT::i8,
+                                                Pair);
+        Out[Bytes + 1] = DAG.getTargetExtractSubreg(Z80::sub_high, DL,
+                                                    MVT::i8, Pair);
+      }
+    } else
+      for (unsigned Bit = 0; Bit != Bits; ++Bit)
+        Out[3] = DAG.getNode(Z80ISD::SLA, DL, VTList, Out[3]);
+  } else {
+    unsigned TopOpc = Opc == ISD::SRA ? Z80ISD::SRA : Z80ISD::SRL;
+    for (unsigned Bit = 0; Bit != Bits; ++Bit) {
+      Out[Live - 1] = DAG.getNode(TopOpc, DL, VTList, Out[Live - 1]);
+      SDValue Carry = Out[Live - 1].getValue(1);
+      for (unsigned I = Live - 1; I != 0; --I) {
+        Out[I - 1] = DAG.getNode(Z80ISD::RR, DL, VTList, Out[I - 1], Carry);
+        Carry = Out[I - 1].getValue(1);
+      }
+    }
+  }
+  return DAG.getNode(ISD::BUILD_PAIR, DL, MVT::i32,
+                     EmitPair(DL, Out[1], Out[0], DAG),
+                     EmitPair(DL, Out[3], Out[2], DAG));
+}
+
+/// Negate or clear the sign of a softened float by flipping or masking the
+/// sign bit, which only touches the high byte.
+SDValue Z80TargetLowering::ExpandFPSign(SDNode *N, SelectionDAG &DAG) const {
+  SDLoc DL(N);
+  EVT VT = N->getValueType(0);
+  unsigned Bits = VT.getSizeInBits();
+  EVT IntVT = EVT::getIntegerVT(*DAG.getContext(), Bits);
+  SDValue Val = DAG.getBitcast(IntVT, N->getOperand(0));
+  APInt Sign = APInt::getSignBit(Bits);
+  if (N->getOpcode() == ISD::FNEG)
+    Val = DAG.getNode(ISD::XOR, DL, IntVT, Val,
+                      DAG.getConstant(Sign, DL, IntVT));
+  else
+    Val = DAG.getNode(ISD::AND, DL, IntVT, Val,
+                      DAG.getConstant(~Sign, DL, IntVT));
+  return DAG.getBitcast(VT, Val);
+}
+
+/// Comparing a float against zero only depends on its bits, so it is done as
+/// an integer comparison.  Equality ignores the sign bit.  The ordering
+/// predicates treat the bits as sign-magnitude, which is only valid without
+/// NaNs.
+SDValue Z80TargetLowering::LowerFPCmpZero(SDValue Op,
+                                          SelectionDAG &DAG) const {
+  SDLoc DL(Op);
+  unsigned Opc = Op.getOpcode();
+  unsigned LHSIdx = Opc == ISD::BR_CC ? 2 : 0;
+  unsigned CCIdx = Opc == ISD::BR_CC ? 1 : Opc == ISD::SETCC ? 2 : 4;
+  SDValue LHS = Op.getOperand(LHSIdx), RHS = Op.getOperand(LHSIdx + 1);
+  ISD::CondCode CC = cast<CondCodeSDNode>(Op.getOperand(CCIdx))->get();
+  if (isa<ConstantFPSDNode>(LHS)) {
+    std::swap(LHS, RHS);
+    CC = ISD::getSetCCSwappedOperands(CC);
+  }
+  auto *ConstRHS = dyn_cast<ConstantFPSDNode>(RHS);
+  if (!ConstRHS || !ConstRHS->isZero())
+    return SDValue();
+  bool NoNaNs = DAG.getTarget().Options.NoNaNsFPMath ||
+                DAG.isKnownNeverNaN(LHS);
+  unsigned Bits = LHS.getValueSizeInBits();
+  EVT IntVT = EVT::getIntegerVT(*DAG.getContext(), Bits);
+  APInt Sign = APInt::getSignBit(Bits);
+  LHS = DAG.getBitcast(IntVT, LHS);
+  RHS = DAG.getConstant(0, DL, IntVT);
+  switch (CC) {
+  default: return SDValue();
+  case ISD::SETUEQ:
+  case ISD::SETONE:
+    if (!NoNaNs)
+      return SDValue();
+    LLVM_FALLTHROUGH;
+  case ISD::SETOEQ:
+  case ISD::SETUNE:
+  case ISD::SETEQ:
+  case ISD::SETNE:
+    LHS = DAG.getNode(ISD::AND, DL, IntVT, LHS,
+                      DAG.getConstant(~Sign, DL, IntVT));
+    CC = CC == ISD::SETOEQ || CC == ISD::SETUEQ || CC == ISD::SETEQ
+             ? ISD::SETEQ : ISD::SETNE;
+    break;
+  case ISD::SETOGT: case ISD::SETUGT: case ISD::SETGT:
+  case ISD::SETOLE: case ISD::SETULE: case ISD::SETLE:
+    if (!NoNaNs)
+      return SDValue();
+    CC = CC == ISD::SETOGT || CC == ISD::SETUGT || CC == ISD::SETGT
+             ? ISD::SETGT : ISD::SETLE;
+    break;
+  case ISD::SETOLT: case ISD::SETULT: case ISD::SETLT:
+  case ISD::SETOGE: case ISD::SETUGE: case ISD::SETGE:
+    // Only values above -0.0 are negative.
+    if (!NoNaNs)
+      return SDValue();
+    CC = CC == ISD::SETOLT || CC == ISD::SETULT || CC == ISD::SETLT
+             ? ISD::SETUGT : ISD::SETULE;
+    RHS = DAG.getConstant(Sign, DL, IntVT);
+    break;
+  }
+  switch (Opc) {
+  default: llvm_unreachable("Unexpected opcode!");
+  case ISD::BR_CC:
+    return DAG.getNode(ISD::BR_CC, DL, MVT::Other, Op.getOperand(0),
+                       DAG.getCondCode(CC), LHS, RHS, Op.getOperand(4));
+  case ISD::SETCC:
+    return DAG.getSetCC(DL, Op.getValueType(), LHS, RHS, CC);
+  case ISD::SELECT_CC:
+    return DAG.getSelectCC(DL, LHS, RHS, Op.getOperand(2), Op.getOperand(3),
+                           CC);
+  }
+}
+
+/// Call an in-place i64 helper.  The left operand is copied to a stack
+/// temporary that the helper overwrites with the result, and the right operand
+/// is passed by address, unless it is a shift amount.  If RetVT is i64 the
+/// result is reloaded from the temporary, otherwise it is the call's return.
+/// The temporaries are shared with the helper calls of other blocks.
+SDValue Z80TargetLowering::EmitI64LibCall(RTLIB::Libcall LC, MVT RetVT,
+                                          SDValue LHS, SDValue RHS,
+                                          const SDLoc &DL,
+                                          SelectionDAG &DAG) const {
+  MachineFunction &MF = DAG.getMachineFunction();
+  const DataLayout &TD = DAG.getDataLayout();
+  MVT PtrVT = getPointerTy(TD);
+  Type *PtrTy = TD.getIntPtrType(*DAG.getContext());
+  SmallVector<SDValue, 2> Stores;
+  SDValue Dst;
+  ArgListTy Args;
+  ArgListEntry Entry;
+  for (SDValue Val : { LHS, RHS }) {
+    if (Val.getValueType() == MVT::i64) {
+      int FI = MF.getInfo<Z80MachineFunctionInfo>()->getI64Slot(MF);
+      SDValue Slot = DAG.getFrameIndex(FI, PtrVT);
+      MachinePointerInfo MPI = MachinePointerInfo::getFixedStack(MF, FI);
+      Stores.push_back(DAG.getStore(DAG.getEntryNode(), DL, Val, Slot, MPI));
+      if (!Dst)
+        Dst = Slot;
+      Entry.Node = Slot;
+      Entry.Ty = PtrTy;
+    } else {
+      Entry.Node = Val;
+      Entry.Ty = Val.getValueType().getTypeForEVT(*DAG.getContext());
+    }
+    Args.push_back(Entry);
+  }
+  SDValue Chain = DAG.getNode(ISD::TokenFactor, DL, MVT::Other, Stores);
+  Type *RetTy = RetVT == MVT::i64 ? Type::getVoidTy(*DAG.getContext())
+                                  : RetVT.getTypeForEVT(*DAG.getContext());
+  CallLoweringInfo CLI(DAG);
+  CLI.setDebugLoc(DL).setChain(Chain).setLibCallee(
+      getLibcallCallingConv(LC), RetTy,
+      DAG.getExternalSymbol(getLibcallName(LC), PtrVT), std::move(Args));
+  std::pair<SDValue, SDValue> CallInfo = LowerCallTo(CLI);
+  if (RetVT != MVT::i64)
+    return CallInfo.first;
+  return DAG.getLoad(MVT::i64, DL, CallInfo.second, Dst,
+                     MachinePointerInfo::getFixedStack(
+                         MF, cast<FrameIndexSDNode>(Dst)->getIndex()));
+}
+
+SDValue Z80TargetLowering::ExpandI64(SDNode *N, SelectionDAG &DAG) const {
+  SDLoc DL(N);
+  if (N->getValueType(0) != MVT::i64)
+    return SDValue();
+  SDValue LHS = N->getOperand(0), RHS = N->getOperand(1);
+  RTLIB::Libcall LC;
+  switch (N->getOpcode()) {
+  default: llvm_unreachable("Unexpected opcode!");
+  case ISD::ADD:  LC = RTLIB::ADD_I64;  break;
+  case ISD::SUB:  LC = RTLIB::SUB_I64;  break;
+  case ISD::MUL:  LC = RTLIB::MUL_I64;  break;
+  case ISD::SDIV: LC = RTLIB::SDIV_I64; break;
+  case ISD::UDIV: LC = RTLIB::UDIV_I64; break;
+  case ISD::SREM: LC = RTLIB::SREM_I64; break;
+  case ISD::UREM: LC = RTLIB::UREM_I64; break;
+  case ISD::SHL:  LC = RTLIB::SHL_I64;  break;
+  case ISD::SRA:  LC = RTLIB::SRA_I64;  break;
+  case ISD::SRL:  LC = RTLIB::SRL_I64;  break;
+  }
+  if (N->getOpcode() == ISD::SHL || N->getOpcode() == ISD::SRA ||
+      N->getOpcode() == ISD::SRL) {
+    // Shifting by whole words only moves registers.
+    if (auto *Shift = dyn_cast<ConstantSDNode>(RHS))
+      if (Shift->getZExtValue() % 16 == 0)
+        return SDValue();
+    RHS = DAG.getZExtOrTrunc(RHS, DL, MVT::i8);
+  }
+  return EmitI64LibCall(LC, MVT::i64, LHS, RHS, DL, DAG);
+}
+
+/// Compare i64 values with the runtime, then test its result against the
+/// equal value with the unsigned form of the condition.
+SDValue Z80TargetLowering::LowerI64Cmp(SDValue Op, SelectionDAG &DAG) const {
+  SDLoc DL(Op);
+  unsigned Opc = Op.getOpcode();
+  unsigned LHSIdx = Opc == ISD::BR_CC ? 2 : 0;
+  unsigned CCIdx = Opc == ISD::BR_CC ? 1 : Opc == ISD::SETCC ? 2 : 4;
+  SDValue LHS = Op.getOperand(LHSIdx), RHS = Op.getOperand(LHSIdx + 1);
+  ISD::CondCode CC = cast<CondCodeSDNode>(Op.getOperand(CCIdx))->get();
+  RTLIB::Libcall LC = RTLIB::CMP_I64;
+  switch (CC) {
+  default: llvm_unreachable("Unexpected condition!");
+  case ISD::SETEQ: case ISD::SETNE:
+  case ISD::SETUGT: case ISD::SETUGE: case ISD::SETULT: case ISD::SETULE:
+    break;
+  case ISD::SETGT: CC = ISD::SETUGT; LC = RTLIB::SCMP_I64; break;
+  case ISD::SETGE: CC = ISD::SETUGE; LC = RTLIB::SCMP_I64; break;
+  case ISD::SETLT: CC = ISD::SETULT; LC = RTLIB::SCMP_I64; break;
+  case ISD::SETLE: CC = ISD::SETULE; LC = RTLIB::SCMP_I64; break;
+  }
+  LHS = EmitI64LibCall(LC, MVT::i8, LHS, RHS, DL, DAG);
+  RHS = DAG.getConstant(1, DL, MVT::i8);
+  switch (Opc) {
+  default: llvm_unreachable("Unexpected opcode!");
+  case ISD::BR_CC:
+    return DAG.getNode(ISD::BR_CC, DL, MVT::Other, Op.getOperand(0),
+                       DAG.getCondCode(CC), LHS, RHS, Op.getOperand(4));
+  case ISD::SETCC:
+    return DAG.getSetCC(DL, Op.getValueType(), LHS, RHS, CC);
+  case ISD::SELECT_CC:
+    return DAG.getSelectCC(DL, LHS, RHS, Op.getOperand(2), Op.getOperand(3),
+                           CC);
+  }
+}
+
 SDValue Z80TargetLowering::LowerSignExtend(SDValue Op,
                                            SelectionDAG &DAG) const {
   assert(Op.getOpcode() == ISD::SIGN_EXTEND && "Unexpected opcode");
@@ -564,6 +1049,20 @@ SDValue Z80TargetLowering::LowerStore(StoreSDNode *Node,
   return Ch;
 }
 
+SDValue Z80TargetLowering::LowerAddrSpaceCast(SDValue Op,
+                                              SelectionDAG &DAG) const {
+  SDLoc DL(Op);
+  auto *Node = cast<AddrSpaceCastSDNode>(Op);
+  SDValue Src = Node->getOperand(0);
+  EVT VT = Op.getValueType();
+  // Short pointers are relative to MBASE, so converting one to a full pointer
+  // has to supply the upper byte.  The other direction just drops it.
+  if (Node->getSrcAddressSpace() == Z80AS::Short &&
+      VT.bitsGT(Src.getValueType()))
+    return EmitMBaseExtend(DL, Src, DAG);
+  return DAG.getZExtOrTrunc(Src, DL, VT);
+}
+
 SDValue Z80TargetLowering::LowerVAStart(SDValue Op, SelectionDAG &DAG) const {
   MachineFunction &MF = DAG.getMachineFunction();
   Z80MachineFunctionInfo *FuncInfo = MF.getInfo<Z80MachineFunctionInfo>();
@@ -575,14 +1074,148 @@ SDValue Z80TargetLowering::LowerVAStart(SDValue Op, SelectionDAG &DAG) const {
                       MachinePointerInfo(SV));
 }
 
+SDValue Z80TargetLowering::LowerINTRINSIC_WO_CHAIN(SDValue Op,
+                                                   SelectionDAG &DAG) const {
+  SDLoc DL(Op);
+  unsigned IntNo = cast<ConstantSDNode>(Op.getOperand(0))->getZExtValue();
+  switch (IntNo) {
+  default: return Op;
+  case Intrinsic::z80_mlt: {
+    SDValue Val = Op.getOperand(1);
+    if (Subtarget.hasZ180Ops())
+      return DAG.getNode(Z80ISD::MLT, DL, MVT::i16, Val);
+    SDValue Lo = DAG.getNode(ISD::AND, DL, MVT::i16, Val,
+                             DAG.getConstant(0xFF, DL, MVT::i16));
+    SDValue Hi = DAG.getNode(ISD::SRL, DL, MVT::i16, Val,
+                             DAG.getConstant(8, DL, MVT::i8));
+    return DAG.getNode(ISD::MUL, DL, MVT::i16, Lo, Hi);
+  }
+  case Intrinsic::z80_bcd_add:
+  case Intrinsic::z80_bcd_sub: {
+    unsigned Opc = IntNo == Intrinsic::z80_bcd_add ? Z80ISD::ADD : Z80ISD::SUB;
+    SDValue Bin = DAG.getNode(Opc, DL, DAG.getVTList(MVT::i8, MVT::i8),
+                              Op.getOperand(1), Op.getOperand(2));
+    return DAG.getNode(Z80ISD::DAA, DL, DAG.getVTList(MVT::i8, MVT::i8),
+                       Bin, Bin.getValue(1));
+  }
+  }
+}
+
+SDValue Z80TargetLowering::LowerINTRINSIC_W_CHAIN(SDValue Op,
+                                                  SelectionDAG &DAG) const {
+  SDLoc DL(Op);
+  switch (cast<ConstantSDNode>(Op.getOperand(1))->getZExtValue()) {
+  default: return Op;
+  case Intrinsic::z80_in: {
+    SDValue Res = DAG.getNode(Z80ISD::IN, DL,
+                              DAG.getVTList(MVT::i8, MVT::Other),
+                              Op.getOperand(0), Op.getOperand(2));
+    return DAG.getMergeValues({ Res, Res.getValue(1) }, DL);
+  }
+  }
+}
+
+/// The block instructions take their operands in fixed registers, so copy them
+/// there glued to the instruction.
+SDValue Z80TargetLowering::LowerINTRINSIC_VOID(SDValue Op,
+                                               SelectionDAG &DAG) const {
+  SDLoc DL(Op);
+  SDValue Ch = Op.getOperand(0);
+  bool Is24Bit = Subtarget.is24Bit();
+  MVT PtrVT = Is24Bit ? MVT::i24 : MVT::i16;
+  unsigned HL = Is24Bit ? Z80::UHL : Z80::HL;
+  unsigned DE = Is24Bit ? Z80::UDE : Z80::DE;
+  unsigned BC = Is24Bit ? Z80::UBC : Z80::BC;
+  unsigned Opc;
+  SmallVector<std::pair<unsigned, SDValue>, 3> Regs;
+  unsigned IntNo = cast<ConstantSDNode>(Op.getOperand(1))->getZExtValue();
+  switch (IntNo) {
+  default: return Op;
+  case Intrinsic::z80_im: {
+    // Only IM 0, 1 and 2 exist, so anything else can't be selected.
+    auto *Mode = dyn_cast<ConstantSDNode>(Op.getOperand(2));
+    if (Mode && Mode->getZExtValue() <= 2)
+      return Op;
+    DAG.getContext()->emitError("interrupt mode must be a constant 0, 1 or 2");
+    return Ch;
+  }
+  case Intrinsic::z80_out:
+    return DAG.getNode(Z80ISD::OUT, DL, MVT::Other, Ch, Op.getOperand(3),
+                       Op.getOperand(2));
+  case Intrinsic::z80_ldir:
+  case Intrinsic::z80_lddr: {
+    if (IntNo == Intrinsic::z80_ldir)
+      Opc = Is24Bit ? Z80::LDIR24 : Z80::LDIR16;
+    else
+      Opc = Is24Bit ? Z80::LDDR24 : Z80::LDDR16;
+    Regs.push_back({ DE, Op.getOperand(2) });
+    Regs.push_back({ HL, Op.getOperand(3) });
+    SDValue Count = Op.getOperand(4);
+    if (Is24Bit) {
+      // A zero count in UBC would mean 16M, so extend the count minus one and
+      // add the one back, which keeps zero meaning 65536.
+      Count = DAG.getNode(ISD::SUB, DL, MVT::i16, Count,
+                          DAG.getConstant(1, DL, MVT::i16));
+      Count = DAG.getNode(ISD::ADD, DL, PtrVT,
+                          DAG.getZExtOrTrunc(Count, DL, PtrVT),
+                          DAG.getConstant(1, DL, PtrVT));
+    }
+    Regs.push_back({ BC, Count });
+    break;
+  }
+  case Intrinsic::z80_inir:
+  case Intrinsic::z80_indr:
+    if (IntNo == Intrinsic::z80_inir)
+      Opc = Is24Bit ? Z80::INIR24 : Z80::INIR16;
+    else
+      Opc = Is24Bit ? Z80::INDR24 : Z80::INDR16;
+    Regs.push_back({ HL, Op.getOperand(2) });
+    Regs.push_back({ Z80::C, Op.getOperand(3) });
+    Regs.push_back({ Z80::B, Op.getOperand(4) });
+    break;
+  case Intrinsic::z80_otir:
+  case Intrinsic::z80_otdr:
+    if (IntNo == Intrinsic::z80_otir)
+      Opc = Is24Bit ? Z80::OTIR24 : Z80::OTIR16;
+    else
+      Opc = Is24Bit ? Z80::OTDR24 : Z80::OTDR16;
+    Regs.push_back({ Z80::C, Op.getOperand(2) });
+    Regs.push_back({ HL, Op.getOperand(3) });
+    Regs.push_back({ Z80::B, Op.getOperand(4) });
+    break;
+  }
+  SDValue Glue;
+  for (auto &Reg : Regs) {
+    Ch = DAG.getCopyToReg(Ch, DL, Reg.first, Reg.second, Glue);
+    Glue = Ch.getValue(1);
+  }
+  return SDValue(DAG.getMachineNode(Opc, DL, MVT::Other, Ch, Glue), 0);
+}
+
 SDValue Z80TargetLowering::LowerOperation(SDValue Op, SelectionDAG &DAG) const {
   DEBUG(dbgs() << "LowerOperation: "; Op->dump(&DAG));
   assert(Op.getResNo() == 0);
   switch (Op.getOpcode()) {
   default: llvm_unreachable("Don't know how to lower this operation.");
-  case ISD::BR_CC:          return LowerBR_CC(Op, DAG);
+  case ISD::BR_CC:
+    if (Op.getOperand(2).getValueType().isFloatingPoint())
+      return LowerFPCmpZero(Op, DAG);
+    if (Op.getOperand(2).getValueType() == MVT::i64)
+      return LowerI64Cmp(Op, DAG);
+    return LowerBR_CC(Op, DAG);
+  case ISD::SETCC:
+    if (Op.getOperand(0).getValueType() == MVT::i64)
+      return LowerI64Cmp(Op, DAG);
+    assert(Op.getOperand(0).getValueType().isFloatingPoint() &&
+           "Integer setcc should have been expanded");
+    return LowerFPCmpZero(Op, DAG);
 //case ISD::SETCC:          return LowerSETCC(Op, DAG);
-  case ISD::SELECT_CC:      return LowerSELECT_CC(Op, DAG);
+  case ISD::SELECT_CC:
+    if (Op.getOperand(0).getValueType().isFloatingPoint())
+      return LowerFPCmpZero(Op, DAG);
+    if (Op.getOperand(0).getValueType() == MVT::i64)
+      return LowerI64Cmp(Op, DAG);
+    return LowerSELECT_CC(Op, DAG);
 //case ISD::ADD:
 //case ISD::SUB:            return LowerAddSub(Op, DAG);
   case ISD::AND:
@@ -603,7 +1236,11 @@ SDValue Z80TargetLowering::LowerOperation(SDValue Op, SelectionDAG &DAG) const {
                                        cast<BlockAddressSDNode>(Op), DAG);
   case ISD::LOAD:           return LowerLoad(cast<LoadSDNode>(Op), DAG);
   case ISD::STORE:          return LowerStore(cast<StoreSDNode>(Op), DAG);
+  case ISD::ADDRSPACECAST:  return LowerAddrSpaceCast(Op, DAG);
   case ISD::VASTART:        return LowerVAStart(Op, DAG);
+  case ISD::INTRINSIC_WO_CHAIN: return LowerINTRINSIC_WO_CHAIN(Op, DAG);
+  case ISD::INTRINSIC_W_CHAIN:  return LowerINTRINSIC_W_CHAIN(Op, DAG);
+  case ISD::INTRINSIC_VOID:     return LowerINTRINSIC_VOID(Op, DAG);
   }
 }
 
@@ -619,7 +1256,64 @@ SDValue Z80TargetLowering::EmitCmp(SDValue LHS, SDValue RHS, SDValue &TargetCC,
     std::swap(LHS, RHS);
     CC = getSetCCSwappedOperands(CC);
   }
+  // Testing a single bit, including the sign bit, only needs the byte that
+  // contains it.
+  SDValue BitSrc;
+  unsigned Bit;
+  if ((CC == ISD::SETEQ || CC == ISD::SETNE) && isNullConstant(RHS) &&
+      LHS.getOpcode() == ISD::AND)
+    if (auto *Mask = dyn_cast<ConstantSDNode>(LHS.getOperand(1)))
+      if (Mask->getAPIntValue().isPowerOf2()) {
+        BitSrc = LHS.getOperand(0);
+        Bit = Mask->getAPIntValue().logBase2();
+      }
+  if ((CC == ISD::SETLT || CC == ISD::SETGE) && isNullConstant(RHS)) {
+    BitSrc = LHS;
+    Bit = VT.getSizeInBits() - 1;
+  }
+  if (BitSrc) {
+    if (Bit >= 8)
+      BitSrc = DAG.getNode(ISD::SRL, DL, VT, BitSrc,
+                           DAG.getConstant(Bit & ~7, DL, MVT::i8));
+    if (VT != MVT::i8)
+      BitSrc = EmitLow(BitSrc, DAG);
+    bool BitClear = CC == ISD::SETEQ || CC == ISD::SETGE;
+    TargetCC = DAG.getConstant(BitClear ? Z80::COND_Z : Z80::COND_NZ, DL,
+                               MVT::i8);
+    return DAG.getNode(Z80ISD::BIT, DL, MVT::i8, BitSrc,
+                       DAG.getConstant(Bit & 7, DL, MVT::i8));
+  }
   ConstantSDNode *Const = dyn_cast<ConstantSDNode>(RHS);
+  // Word equality against a constant doesn't need a full width subtract, which
+  // needs the constant in a register and HL restored afterwards.
+  if ((CC == ISD::SETEQ || CC == ISD::SETNE) && VT != MVT::i8 && Const) {
+    // A value that dies here can be stepped to zero with INC or DEC.
+    if (Const->isOne() || Const->isAllOnesValue())
+      if (LHS.hasOneUse()) {
+        LHS = DAG.getNode(ISD::ADD, DL, VT, LHS,
+                          DAG.getConstant(-Const->getSExtValue(), DL, VT));
+        RHS = DAG.getConstant(0, DL, VT);
+        Const = cast<ConstantSDNode>(RHS);
+      }
+    // Otherwise, if one byte of the constant is zero, clear the other byte
+    // with XOR and OR the two together, leaving the value intact.  Wider
+    // values can't get at their upper byte, so they are compared against zero
+    // with ADD and SBC, which also leaves the value intact.
+    uint64_t Imm = Const->getZExtValue();
+    if (VT == MVT::i16 && (Imm <= 0xFF || !(Imm & 0xFF))) {
+      SDValue Hi = EmitHigh(LHS, DAG), Lo = EmitLow(LHS, DAG);
+      if (Imm & 0xFF)
+        Lo = DAG.getNode(ISD::XOR, DL, MVT::i8, Lo,
+                         DAG.getConstant(Imm, DL, MVT::i8));
+      else if (Imm)
+        Hi = DAG.getNode(ISD::XOR, DL, MVT::i8, Hi,
+                         DAG.getConstant(Imm >> 8, DL, MVT::i8));
+      TargetCC = DAG.getConstant(CC == ISD::SETEQ ? Z80::COND_Z : Z80::COND_NZ,
+                                 DL, MVT::i8);
+      return DAG.getNode(Z80ISD::OR, DL, DAG.getVTList(MVT::i8, MVT::i8), Hi,
+                         Lo).getValue(1);
+    }
+  }
   int32_t SignVal = 1 << (VT.getSizeInBits() - 1), ConstVal;
   if (Const)
     ConstVal = Const->getSExtValue();
@@ -981,11 +1675,37 @@ SDValue Z80TargetLowering::LowerSELECT_CC(SDValue Op, SelectionDAG &DAG) const {
   SDValue TV  = Op.getOperand(2);
   SDValue FV  = Op.getOperand(3);
   ISD::CondCode CC = cast<CondCodeSDNode>(Op.getOperand(4))->get();
+  EVT VT = Op.getValueType();
   SDLoc DL(Op);
 
+  // Testing for zero is the same as an unsigned compare against one, which
+  // leaves the result in carry where it can be used without a branch.
+  bool CarrySelect = isCarrySelectCheap(VT, TV, FV);
+  if (CarrySelect && (CC == ISD::SETEQ || CC == ISD::SETNE) &&
+      isNullConstant(RHS)) {
+    CC = CC == ISD::SETEQ ? ISD::SETULT : ISD::SETUGE;
+    RHS = DAG.getConstant(1, DL, RHS.getValueType());
+  }
+
+  // Likewise, a sign test can shift the sign into carry instead of testing it
+  // with BIT.
+  if (CarrySelect && (CC == ISD::SETLT || CC == ISD::SETGE) &&
+      isNullConstant(RHS)) {
+    SDValue Flag = EmitSignToCarry(LHS, DAG);
+    return CC == ISD::SETLT ? EmitCarrySelect(DL, VT, TV, FV, Flag, DAG)
+                            : EmitCarrySelect(DL, VT, FV, TV, Flag, DAG);
+  }
+
   SDValue TargetCC;
   SDValue Flag = EmitCmp(LHS, RHS, TargetCC, CC, DL, DAG);
 
+  if (CarrySelect) {
+    switch (cast<ConstantSDNode>(TargetCC)->getZExtValue()) {
+    case Z80::COND_C:  return EmitCarrySelect(DL, VT, TV, FV, Flag, DAG);
+    case Z80::COND_NC: return EmitCarrySelect(DL, VT, FV, TV, Flag, DAG);
+    }
+  }
+
   return DAG.getNode(Z80ISD::SELECT, DL,
                      DAG.getVTList(Op.getValueType(), MVT::Glue), TV, FV,
                      TargetCC, Flag);
@@ -1130,19 +1850,86 @@ bool Z80TargetLowering::isOffsetFoldingLegal(
 bool Z80TargetLowering::isLegalAddressingMode(const DataLayout &DL,
                                               const AddrMode &AM, Type *Ty,
                                               unsigned AS) const {
-  if (AM.Scale)
+  // There are no scaled or register + register modes.
+  if (AM.Scale > 1 || (AM.Scale == 1 && AM.HasBaseReg))
     return false;
+  bool HasBaseReg = AM.HasBaseReg || AM.Scale == 1;
 
-  if (AM.BaseGV && AM.HasBaseReg)
-    return false;
+  // Short pointers are only accessed through a plain register.
+  if (AS == Z80AS::Short && Subtarget.is24Bit())
+    return HasBaseReg && !AM.BaseGV && !AM.BaseOffs;
 
+  // Absolute (nn) addresses can fold any constant offset, but not a register.
+  if (!HasBaseReg)
+    return true;
   if (AM.BaseGV)
-    return AM.BaseOffs == 0;
+    return false;
 
-  if (AM.HasBaseReg)
-    return isInt<8>(AM.BaseOffs);
+  // (ix+d) and (iy+d) need every byte of the access in the displacement range,
+  // since without eZ80 ops multibyte accesses are split into byte accesses.
+  unsigned Span = 1;
+  if (!Subtarget.hasEZ80Ops() && Ty && Ty->isSized())
+    Span = DL.getTypeStoreSize(Ty);
+  return isInt<8>(AM.BaseOffs) && isInt<8>(AM.BaseOffs + Span - 1);
+}
+
+/// Return the size of the access done by an indexable memory node, or zero if
+/// it can't be indexed.
+static unsigned getIndexedAccessSize(SDNode *N, SDValue &Ptr) {
+  EVT VT;
+  if (auto *Load = dyn_cast<LoadSDNode>(N)) {
+    if (Load->getExtensionType() != ISD::NON_EXTLOAD)
+      return 0;
+    VT = Load->getMemoryVT();
+    Ptr = Load->getBasePtr();
+  } else if (auto *Store = dyn_cast<StoreSDNode>(N)) {
+    if (Store->isTruncatingStore())
+      return 0;
+    VT = Store->getMemoryVT();
+    Ptr = Store->getBasePtr();
+  } else
+    return 0;
+  if (VT != MVT::i8 && VT != MVT::i16 && VT != MVT::i24)
+    return 0;
+  // The pointer update pseudos only access memory through full pointers.
+  if (cast<MemSDNode>(N)->getAddressSpace() != Z80AS::Default)
+    return 0;
+  return VT.getStoreSize();
+}
+
+bool Z80TargetLowering::getPreIndexedAddressParts(SDNode *N, SDValue &Base,
+                                                  SDValue &Offset,
+                                                  ISD::MemIndexedMode &AM,
+                                                  SelectionDAG &DAG) const {
+  SDValue Ptr;
+  unsigned Size = getIndexedAccessSize(N, Ptr);
+  if (!Size || Ptr.getOpcode() != ISD::ADD)
+    return false;
+  auto *C = dyn_cast<ConstantSDNode>(Ptr.getOperand(1));
+  if (!C || C->getSExtValue() != -int64_t(Size))
+    return false;
+  Base = Ptr.getOperand(0);
+  Offset = DAG.getConstant(Size, SDLoc(N), Ptr.getValueType());
+  AM = ISD::PRE_DEC;
+  return true;
+}
 
-  return false;
+bool Z80TargetLowering::getPostIndexedAddressParts(SDNode *N, SDNode *Op,
+                                                   SDValue &Base,
+                                                   SDValue &Offset,
+                                                   ISD::MemIndexedMode &AM,
+                                                   SelectionDAG &DAG) const {
+  SDValue Ptr;
+  unsigned Size = getIndexedAccessSize(N, Ptr);
+  if (!Size || Op->getOpcode() != ISD::ADD || Op->getOperand(0) != Ptr)
+    return false;
+  auto *C = dyn_cast<ConstantSDNode>(Op->getOperand(1));
+  if (!C || C->getSExtValue() != int64_t(Size))
+    return false;
+  Base = Ptr;
+  Offset = Op->getOperand(1);
+  AM = ISD::POST_INC;
+  return true;
 }
 
 bool Z80TargetLowering::isLegalICmpImmediate(int64_t Imm) const {
@@ -1335,8 +2122,7 @@ static SDValue combineMul(SDNode *N, SelectionDAG &DAG,
   SDValue N0 = N->getOperand(0);
   SDValue N1 = N->getOperand(1);
   SDLoc DL(N);
-  bool OptSize = DAG.getMachineFunction().getFunction()->getAttributes()
-    .hasAttribute(AttributeList::FunctionIndex, Attribute::OptimizeForSize);
+  bool OptSize = shouldOptForSize(DAG);
   if (OptSize)
     return SDValue();
   if (VT == MVT::i8 && Subtarget.hasZ180Ops())
@@ -1400,6 +2186,81 @@ static SDValue combineSExt(SDNode *N, SelectionDAG &DAG,
   return SDValue();
 }
 
+/// Accesses through short pointers are selected as .sis instructions, which
+/// only exist for 8 and 16-bit data, so wider accesses have to go through an
+/// extended pointer instead.
+SDValue Z80TargetLowering::combineShortPtrAccess(LSBaseSDNode *N,
+                                                 SelectionDAG &DAG) const {
+  SDValue Ptr = N->getBasePtr();
+  if (Ptr.getValueType() != MVT::i16 || !N->isUnindexed() ||
+      N->getMemoryVT().getStoreSize() <= 2)
+    return SDValue();
+  // Each access gets a temporary of its own, since accesses on the same chain
+  // aren't ordered against each other.
+  SmallVector<SDValue, 4> Ops(N->op_begin(), N->op_end());
+  Ops[isa<LoadSDNode>(N) ? 1 : 2] = EmitMBaseExtend(SDLoc(N), Ptr, DAG);
+  return SDValue(DAG.UpdateNodeOperands(N, Ops), 0);
+}
+
+/// Accesses to the I/O address space become one IN or OUT per byte, at
+/// consecutive ports, in order.
+SDValue Z80TargetLowering::combinePortAccess(LSBaseSDNode *N,
+                                             DAGCombinerInfo &DCI) const {
+  SelectionDAG &DAG = DCI.DAG;
+  SDLoc DL(N);
+  SDValue Ch = N->getChain();
+  SDValue Port = DAG.getZExtOrTrunc(N->getBasePtr(), DL, MVT::i16);
+  EVT MemVT = N->getMemoryVT();
+  if (!MemVT.isInteger())
+    return SDValue();
+  unsigned Size = MemVT.getStoreSize();
+  MemVT = EVT::getIntegerVT(*DAG.getContext(), 8 * Size);
+  auto getPort = [&](unsigned I) {
+    return I ? DAG.getNode(ISD::ADD, DL, MVT::i16, Port,
+                           DAG.getConstant(I, DL, MVT::i16)) : Port;
+  };
+  if (auto *Load = dyn_cast<LoadSDNode>(N)) {
+    EVT VT = Load->getValueType(0);
+    if (!VT.isInteger())
+      return SDValue();
+    SDValue Res;
+    for (unsigned I = 0; I != Size; ++I) {
+      SDValue Byte = DAG.getNode(Z80ISD::IN, DL,
+                                 DAG.getVTList(MVT::i8, MVT::Other),
+                                 Ch, getPort(I));
+      Ch = Byte.getValue(1);
+      Byte = DAG.getZExtOrTrunc(Byte, DL, MemVT);
+      if (I)
+        Res = DAG.getNode(
+            ISD::OR, DL, MemVT, Res,
+            DAG.getNode(ISD::SHL, DL, MemVT, Byte,
+                        DAG.getConstant(8 * I, DL, getShiftAmountTy(
+                            MemVT, DAG.getDataLayout()))));
+      else
+        Res = Byte;
+    }
+    if (Load->getExtensionType() == ISD::SEXTLOAD)
+      Res = DAG.getSExtOrTrunc(Res, DL, VT);
+    else
+      Res = DAG.getZExtOrTrunc(Res, DL, VT);
+    return DCI.CombineTo(N, Res, Ch);
+  }
+  SDValue Val = cast<StoreSDNode>(N)->getValue();
+  EVT VT = Val.getValueType();
+  if (!VT.isInteger())
+    return SDValue();
+  for (unsigned I = 0; I != Size; ++I) {
+    SDValue Byte = Val;
+    if (I)
+      Byte = DAG.getNode(ISD::SRL, DL, VT, Byte,
+                         DAG.getConstant(8 * I, DL, getShiftAmountTy(
+                             VT, DAG.getDataLayout())));
+    Byte = DAG.getZExtOrTrunc(Byte, DL, MVT::i8);
+    Ch = DAG.getNode(Z80ISD::OUT, DL, MVT::Other, Ch, Byte, getPort(I));
+  }
+  return Ch;
+}
+
 SDValue Z80TargetLowering::PerformDAGCombine(SDNode *N,
                                              DAGCombinerInfo &DCI) const {
   if (N->isMachineOpcode())
@@ -1412,6 +2273,15 @@ SDValue Z80TargetLowering::PerformDAGCombine(SDNode *N,
   default:            return SDValue();
   case ISD::MUL:      return combineMul(N, DCI.DAG, Subtarget);
   case ISD::TRUNCATE: return combineTruncate(N, DCI.DAG);
+  case ISD::LOAD:
+  case ISD::STORE: {
+    auto *Mem = cast<LSBaseSDNode>(N);
+    if (Mem->getAddressSpace() == Z80AS::IO)
+      return combinePortAccess(Mem, DCI);
+    if (Subtarget.is24Bit())
+      return combineShortPtrAccess(Mem, DCI.DAG);
+    return SDValue();
+  }
   case Z80ISD::SUB:   return combineSub(N, DCI);
   case Z80ISD::SEXT:  return combineSExt(N, DCI.DAG, Subtarget);
   }
@@ -1529,6 +2399,15 @@ Z80TargetLowering::EmitInstrWithCustomInserter(MachineInstr &MI,
   case Z80::SExt16:
   case Z80::SExt24:
     return EmitLoweredSExt(MI, BB);
+  case Z80::InLoop16:
+  case Z80::InLoop24:
+  case Z80::OutLoop16:
+  case Z80::OutLoop24:
+  case Z80::InLoop16r:
+  case Z80::InLoop24r:
+  case Z80::OutLoop16r:
+  case Z80::OutLoop24r:
+    return EmitLoweredPortLoop(MI, BB);
   }
 }
 
@@ -1698,6 +2577,118 @@ MachineBasicBlock *Z80TargetLowering::EmitLoweredSExt(
   return BB;
 }
 
+/// Expand a copy between memory and consecutive ports into a loop that goes
+/// through BC for the port and steps the memory pointer with a post-increment
+/// access.  A constant count is kept in a byte register, a register count is
+/// tested for zero through HL before each iteration.
+MachineBasicBlock *
+Z80TargetLowering::EmitLoweredPortLoop(MachineInstr &MI,
+                                       MachineBasicBlock *BB) const {
+  const TargetInstrInfo *TII = Subtarget.getInstrInfo();
+  MachineFunction *F = BB->getParent();
+  MachineRegisterInfo &MRI = F->getRegInfo();
+  DebugLoc DL = MI.getDebugLoc();
+  unsigned Opc = MI.getOpcode();
+  bool ToPort = Opc == Z80::OutLoop16 || Opc == Z80::OutLoop24 ||
+                Opc == Z80::OutLoop16r || Opc == Z80::OutLoop24r;
+  bool Is24BitMem = Opc == Z80::InLoop24 || Opc == Z80::OutLoop24 ||
+                    Opc == Z80::InLoop24r || Opc == Z80::OutLoop24r;
+  bool RegCount = MI.getOperand(2).isReg();
+  const TargetRegisterClass *MemRC = Is24BitMem ? &Z80::A24RegClass
+                                                : &Z80::A16RegClass;
+  const TargetRegisterClass *CountRC =
+      !RegCount ? &Z80::R8RegClass
+                : Is24BitMem ? &Z80::R24RegClass : &Z80::R16RegClass;
+  unsigned HL = Is24BitMem ? Z80::UHL : Z80::HL;
+  unsigned TestZeroOpc = Is24BitMem ? Z80::CP24a0 : Z80::CP16a0;
+
+  //  thisMBB:
+  //   %CountIn = ld count
+  //   # fallthrough to loopMBB
+  // or with a register count:
+  //   hl = %CountIn
+  //   cp hl, 0
+  //   jp z, doneMBB
+  const BasicBlock *LLVM_BB = BB->getBasicBlock();
+  MachineFunction::iterator I = ++BB->getIterator();
+  MachineBasicBlock *thisMBB = BB;
+  MachineBasicBlock *loopMBB = F->CreateMachineBasicBlock(LLVM_BB);
+  MachineBasicBlock *doneMBB = F->CreateMachineBasicBlock(LLVM_BB);
+  F->insert(I, loopMBB);
+  F->insert(I, doneMBB);
+  doneMBB->splice(doneMBB->begin(), BB,
+                  std::next(MachineBasicBlock::iterator(MI)), BB->end());
+  doneMBB->transferSuccessorsAndUpdatePHIs(BB);
+  BB->addSuccessor(loopMBB);
+  loopMBB->addSuccessor(loopMBB);
+  loopMBB->addSuccessor(doneMBB);
+
+  unsigned CountIn;
+  if (RegCount) {
+    CountIn = MI.getOperand(2).getReg();
+    BuildMI(BB, DL, TII->get(TargetOpcode::COPY), HL).addReg(CountIn);
+    BuildMI(BB, DL, TII->get(TestZeroOpc));
+    BuildMI(BB, DL, TII->get(Z80::JQCC)).addMBB(doneMBB).addImm(Z80::COND_Z);
+    BB->addSuccessor(doneMBB);
+  } else {
+    CountIn = MRI.createVirtualRegister(CountRC);
+    BuildMI(BB, DL, TII->get(Z80::LD8ri), CountIn).add(MI.getOperand(2));
+  }
+
+  //  loopMBB:
+  //   %Mem = phi [ %MemIn, thisMBB ], [ %MemNext, loopMBB ]
+  //   %Port = phi [ %PortIn, thisMBB ], [ %PortNext, loopMBB ]
+  //   %Count = phi [ %CountIn, thisMBB ], [ %CountNext, loopMBB ]
+  //   ld %Byte, (%Mem++) / in %Byte, (c)
+  //   out (c), %Byte / ld (%Mem++), %Byte
+  //   %PortNext = inc %Port
+  //   %CountNext = dec %Count
+  //   jp nz, loopMBB
+  // where a register count is tested through hl before the branch.
+  unsigned Mem = MRI.createVirtualRegister(MemRC);
+  unsigned MemNext = MRI.createVirtualRegister(MemRC);
+  unsigned Port = MRI.createVirtualRegister(&Z80::R16RegClass);
+  unsigned PortNext = MRI.createVirtualRegister(&Z80::R16RegClass);
+  unsigned Count = MRI.createVirtualRegister(CountRC);
+  unsigned CountNext = MRI.createVirtualRegister(CountRC);
+  unsigned Byte = MRI.createVirtualRegister(&Z80::G8RegClass);
+  BuildMI(loopMBB, DL, TII->get(Z80::PHI), Mem)
+    .addReg(MI.getOperand(0).getReg()).addMBB(thisMBB)
+    .addReg(MemNext).addMBB(loopMBB);
+  BuildMI(loopMBB, DL, TII->get(Z80::PHI), Port)
+    .addReg(MI.getOperand(1).getReg()).addMBB(thisMBB)
+    .addReg(PortNext).addMBB(loopMBB);
+  BuildMI(loopMBB, DL, TII->get(Z80::PHI), Count)
+    .addReg(CountIn).addMBB(thisMBB)
+    .addReg(CountNext).addMBB(loopMBB);
+  if (ToPort) {
+    BuildMI(loopMBB, DL, TII->get(Is24BitMem ? Z80::LD8rpu24 : Z80::LD8rpu16),
+            Byte).addReg(MemNext, RegState::Define).addReg(Mem).addImm(1);
+    BuildMI(loopMBB, DL, TII->get(TargetOpcode::COPY), Z80::BC).addReg(Port);
+    BuildMI(loopMBB, DL, TII->get(Z80::OUT8cr)).addReg(Byte);
+  } else {
+    BuildMI(loopMBB, DL, TII->get(TargetOpcode::COPY), Z80::BC).addReg(Port);
+    BuildMI(loopMBB, DL, TII->get(Z80::IN8rc), Byte);
+    BuildMI(loopMBB, DL, TII->get(Is24BitMem ? Z80::LD8pru24 : Z80::LD8pru16),
+            MemNext).addReg(Mem).addReg(Byte).addImm(1);
+  }
+  BuildMI(loopMBB, DL, TII->get(Z80::INC16r), PortNext).addReg(Port);
+  if (RegCount) {
+    // Decrementing a register pair doesn't set the flags.
+    BuildMI(loopMBB, DL, TII->get(Is24BitMem ? Z80::DEC24r : Z80::DEC16r),
+            CountNext).addReg(Count);
+    BuildMI(loopMBB, DL, TII->get(TargetOpcode::COPY), HL).addReg(CountNext);
+    BuildMI(loopMBB, DL, TII->get(TestZeroOpc));
+  } else
+    BuildMI(loopMBB, DL, TII->get(Z80::DEC8r), CountNext).addReg(Count);
+  BuildMI(loopMBB, DL, TII->get(Z80::JQCC)).addMBB(loopMBB)
+    .addImm(Z80::COND_NZ);
+
+  MI.eraseFromParent();   // The pseudo instruction is gone now.
+  DEBUG(F->dump());
+  return doneMBB;
+}
+
 //===----------------------------------------------------------------------===//
 //               Return Value Calling Convention Implementation
 //===----------------------------------------------------------------------===//
@@ -1741,6 +2732,111 @@ CCAssignFn *Z80TargetLowering::getRetCCAssignFn(CallingConv::ID CallConv) const
   }
 }
 
+/// Return true if F has a call marked tail that is directly followed by a
+/// return, which is the only kind that can be lowered as a tail call that
+/// stores over the incoming arguments.
+static bool hasTailCallSite(const Function &F) {
+  if (F.getFnAttribute("disable-tail-calls").getValueAsString() == "true")
+    return false;
+  for (const BasicBlock &BB : F)
+    if (auto *Ret = dyn_cast<ReturnInst>(BB.getTerminator()))
+      if (auto *Call = dyn_cast_or_null<CallInst>(Ret->getPrevNode()))
+        if (Call->isTailCall())
+          return true;
+  return false;
+}
+
+/// MatchingStackOffset - Return true if the given stack call argument is
+/// already available in the same position (relatively) of the caller's
+/// incoming argument stack.
+static bool MatchingStackOffset(SDValue Arg, unsigned Offset,
+                                ISD::ArgFlagsTy Flags, MachineFrameInfo &MFI,
+                                const MachineRegisterInfo *MRI,
+                                const TargetInstrInfo *TII) {
+  unsigned Bytes = Arg.getValueType().getStoreSize();
+  unsigned NumElements = 0, Elements = 0;
+  while (true) {
+    switch (Arg.getOpcode()) {
+    case ISD::BUILD_PAIR:
+      if (NumElements--) {
+        Arg = Arg.getOperand(Elements & 1);
+        Elements >>= 1;
+        continue;
+      }
+      break;
+    case ISD::EXTRACT_ELEMENT:
+      assert(NumElements < 8*sizeof(Elements) && "Overflowed Elements");
+      Elements <<= 1;
+      Elements |= Arg.getConstantOperandVal(1);
+      ++NumElements;
+      LLVM_FALLTHROUGH;
+    case ISD::SIGN_EXTEND:
+    case ISD::ZERO_EXTEND:
+    case ISD::ANY_EXTEND:
+    case ISD::BITCAST:
+      Arg = Arg.getOperand(0);
+      continue;
+    case ISD::SRL:
+    case ISD::SRA:
+      if (ConstantSDNode *Amt = dyn_cast<ConstantSDNode>(Arg.getOperand(1))) {
+        SDValue Val = Arg.getOperand(0);
+        if (Val.getOpcode() == ISD::TRUNCATE)
+          Val = Val.getOperand(0);
+        if (Val.getOpcode() == ISD::BUILD_PAIR &&
+            Val.getOperand(0).getValueSizeInBits() == Amt->getZExtValue()) {
+          Arg = Val.getOperand(1);
+          continue;
+        }
+      }
+      break;
+    case ISD::TRUNCATE:
+      EVT TruncVT = Arg.getValueType();
+      Arg = Arg.getOperand(0);
+      switch (Arg.getOpcode()) {
+      case ISD::BUILD_PAIR:
+        if (TruncVT.bitsLE(Arg.getOperand(0).getValueType()))
+          Arg = Arg.getOperand(0);
+        break;
+      case ISD::AssertZext:
+      case ISD::AssertSext:
+        Arg = Arg.getOperand(0);
+        break;
+      }
+      continue;
+    }
+    break;
+  }
+
+  int FI = INT_MAX;
+  if (Arg.getOpcode() == ISD::CopyFromReg) {
+    unsigned VR = cast<RegisterSDNode>(Arg.getOperand(1))->getReg();
+    if (!TargetRegisterInfo::isVirtualRegister(VR))
+      return false;
+    MachineInstr *Def = MRI->getVRegDef(VR);
+    if (!Def)
+      return false;
+    if (Flags.isByVal() || !TII->isLoadFromStackSlot(*Def, FI))
+      return false;
+  } else if (LoadSDNode *Ld = dyn_cast<LoadSDNode>(Arg)) {
+    if (Flags.isByVal())
+      return false;
+    SDValue Ptr = Ld->getBasePtr();
+    if (FrameIndexSDNode *FINode = dyn_cast<FrameIndexSDNode>(Ptr))
+      FI = FINode->getIndex();
+    else
+      return false;
+  } else if (Arg.getOpcode() == ISD::FrameIndex && Flags.isByVal()) {
+    FrameIndexSDNode *FINode = cast<FrameIndexSDNode>(Arg);
+    FI = FINode->getIndex();
+    Bytes = Flags.getByValSize();
+  } else
+    return false;
+
+  assert(FI != INT_MAX);
+  return MFI.isFixedObjectIndex(FI) && Offset == MFI.getObjectOffset(FI) &&
+    Bytes <= MFI.getObjectSize(FI);
+}
+
 SDValue Z80TargetLowering::LowerCall(TargetLowering::CallLoweringInfo &CLI,
                                      SmallVectorImpl<SDValue> &InVals) const {
   SelectionDAG &DAG                     = CLI.DAG;
@@ -1773,10 +2869,38 @@ SDValue Z80TargetLowering::LowerCall(TargetLowering::CallLoweringInfo &CLI,
   unsigned NumBytes = CCInfo.getAlignedCallFrameSize();
   MVT PtrVT = getPointerTy(DAG.getDataLayout());
 
+  // IY is caller saved, so the small data base has to be reloaded after a
+  // call unless the callee is known to keep it.  Only functions defined here
+  // are, since they are built with IY reserved too.  Anything else, such as a
+  // prebuilt library or a runtime helper taking an argument in IY, may
+  // overwrite it.
+  unsigned SmallDataBaseReg = Z80::NoRegister;
+  if (Z80TargetObjectFile::hasSmallData()) {
+    bool PreservesBase = false;
+    if (auto *G = dyn_cast<GlobalAddressSDNode>(Callee))
+      if (auto *F = dyn_cast<Function>(G->getGlobal()))
+        PreservesBase = F->isStrongDefinitionForLinker();
+    for (const CCValAssign &VA : ArgLocs)
+      if (VA.isRegLoc() && TRI->regsOverlap(VA.getLocReg(), Z80::UIY))
+        PreservesBase = false;
+    if (!PreservesBase)
+      SmallDataBaseReg = Subtarget.is24Bit() ? Z80::UIY : Z80::IY;
+  }
+  if (SmallDataBaseReg)
+    IsTailCall = false;
+
   if (!IsTailCall)
     Chain = DAG.getCALLSEQ_START(
         Chain, DAG.getTargetConstant(NumBytes, DL, PtrVT), DL);
 
+  // Stack arguments of a tail call are stored over our own incoming ones,
+  // after every load of those has been done.
+  SDValue ArgChain;
+  SmallVector<SDValue, 8> MemOpChains;
+  if (IsTailCall)
+    ArgChain = DAG.getStackArgumentTokenFactor(Chain);
+  MachineFrameInfo &MFI = MF.getFrameInfo();
+
   SmallVector<std::pair<unsigned, SDValue>, 2> RegsToPass;
   const TargetRegisterInfo *RegInfo = Subtarget.getRegisterInfo();
 
@@ -1817,7 +2941,17 @@ SDValue Z80TargetLowering::LowerCall(TargetLowering::CallLoweringInfo &CLI,
 
     if (VA.isRegLoc()) {
       RegsToPass.push_back(std::make_pair(Reg, Val));
-    } else if (!IsTailCall) {
+    } else if (IsTailCall) {
+      assert(VA.isMemLoc());
+      if (MatchingStackOffset(OutVals[I-1], VA.getLocMemOffset(), OA.Flags,
+                              MFI, &MF.getRegInfo(), Subtarget.getInstrInfo()))
+        continue;
+      int FI = MFI.CreateFixedObject(LocVT.getStoreSize(),
+                                     VA.getLocMemOffset(), false);
+      MemOpChains.push_back(DAG.getStore(
+          ArgChain, DL, Val, DAG.getFrameIndex(FI, PtrVT),
+          MachinePointerInfo::getFixedStack(MF, FI)));
+    } else {
       assert(VA.isMemLoc());
 #if 1
       Chain = DAG.getMemIntrinsicNode(
@@ -1837,6 +2971,9 @@ SDValue Z80TargetLowering::LowerCall(TargetLowering::CallLoweringInfo &CLI,
     }
   }
 
+  if (!MemOpChains.empty())
+    Chain = DAG.getNode(ISD::TokenFactor, DL, MVT::Other, MemOpChains);
+
   // Build a sequence of copy-to-reg nodes chained together with a token chain
   // and flag operands with copy the outgoing args into registers.
   SDValue InFlag;
@@ -1877,7 +3014,7 @@ SDValue Z80TargetLowering::LowerCall(TargetLowering::CallLoweringInfo &CLI,
     Ops.push_back(InFlag);
 
   if (IsTailCall) {
-    MF.getFrameInfo().setHasTailCall();
+    MFI.setHasTailCall();
     return DAG.getNode(Z80ISD::TC_RETURN, DL, NodeTys, Ops);
   }
 
@@ -1892,99 +3029,15 @@ SDValue Z80TargetLowering::LowerCall(TargetLowering::CallLoweringInfo &CLI,
 
   // Handle result values, copying them out of physregs into vregs that we
   // return.
-  return LowerCallResult(Chain, InFlag, CallConv, IsVarArg, Ins, DL, DAG,
-                         InVals);
-}
-
-/// MatchingStackOffset - Return true if the given stack call argument is
-/// already available in the same position (relatively) of the caller's
-/// incoming argument stack.
-static bool MatchingStackOffset(SDValue Arg, unsigned Offset,
-                                ISD::ArgFlagsTy Flags, MachineFrameInfo &MFI,
-                                const MachineRegisterInfo *MRI,
-                                const TargetInstrInfo *TII) {
-  unsigned Bytes = Arg.getValueType().getStoreSize();
-  unsigned NumElements = 0, Elements = 0;
-  while (true) {
-    switch (Arg.getOpcode()) {
-    case ISD::BUILD_PAIR:
-      if (NumElements--) {
-        Arg = Arg.getOperand(Elements & 1);
-        Elements >>= 1;
-        continue;
-      }
-      break;
-    case ISD::EXTRACT_ELEMENT:
-      assert(NumElements < 8*sizeof(Elements) && "Overflowed Elements");
-      Elements <<= 1;
-      Elements |= Arg.getConstantOperandVal(1);
-      ++NumElements;
-      LLVM_FALLTHROUGH;
-    case ISD::SIGN_EXTEND:
-    case ISD::ZERO_EXTEND:
-    case ISD::ANY_EXTEND:
-    case ISD::BITCAST:
-      Arg = Arg.getOperand(0);
-      continue;
-    case ISD::SRL:
-    case ISD::SRA:
-      if (ConstantSDNode *Amt = dyn_cast<ConstantSDNode>(Arg.getOperand(1))) {
-        SDValue Val = Arg.getOperand(0);
-        if (Val.getOpcode() == ISD::TRUNCATE)
-          Val = Val.getOperand(0);
-        if (Val.getOpcode() == ISD::BUILD_PAIR &&
-            Val.getOperand(0).getValueSizeInBits() == Amt->getZExtValue()) {
-          Arg = Val.getOperand(1);
-          continue;
-        }
-      }
-      break;
-    case ISD::TRUNCATE:
-      EVT TruncVT = Arg.getValueType();
-      Arg = Arg.getOperand(0);
-      switch (Arg.getOpcode()) {
-      case ISD::BUILD_PAIR:
-        if (TruncVT.bitsLE(Arg.getOperand(0).getValueType()))
-          Arg = Arg.getOperand(0);
-        break;
-      case ISD::AssertZext:
-      case ISD::AssertSext:
-        Arg = Arg.getOperand(0);
-        break;
-      }
-      continue;
-    }
-    break;
-  }
-
-  int FI = INT_MAX;
-  if (Arg.getOpcode() == ISD::CopyFromReg) {
-    unsigned VR = cast<RegisterSDNode>(Arg.getOperand(1))->getReg();
-    if (!TargetRegisterInfo::isVirtualRegister(VR))
-      return false;
-    MachineInstr *Def = MRI->getVRegDef(VR);
-    if (!Def)
-      return false;
-    if (Flags.isByVal() || !TII->isLoadFromStackSlot(*Def, FI))
-      return false;
-  } else if (LoadSDNode *Ld = dyn_cast<LoadSDNode>(Arg)) {
-    if (Flags.isByVal())
-      return false;
-    SDValue Ptr = Ld->getBasePtr();
-    if (FrameIndexSDNode *FINode = dyn_cast<FrameIndexSDNode>(Ptr))
-      FI = FINode->getIndex();
-    else
-      return false;
-  } else if (Arg.getOpcode() == ISD::FrameIndex && Flags.isByVal()) {
-    FrameIndexSDNode *FINode = cast<FrameIndexSDNode>(Arg);
-    FI = FINode->getIndex();
-    Bytes = Flags.getByValSize();
-  } else
-    return false;
-
-  assert(FI != INT_MAX);
-  return MFI.isFixedObjectIndex(FI) && Offset == MFI.getObjectOffset(FI) &&
-    Bytes <= MFI.getObjectSize(FI);
+  Chain = LowerCallResult(Chain, InFlag, CallConv, IsVarArg, Ins, DL, DAG,
+                          InVals);
+  if (SmallDataBaseReg)
+    Chain = DAG.getCopyToReg(
+        Chain, DL, SmallDataBaseReg,
+        DAG.getNode(Z80ISD::Wrapper, DL, PtrVT,
+                    DAG.getTargetExternalSymbol(
+                        Z80TargetObjectFile::getSmallDataBaseName(), PtrVT)));
+  return Chain;
 }
 
 /// Check whether the call is eligible for tail call optimization. Targets
@@ -1997,38 +3050,60 @@ bool Z80TargetLowering::IsEligibleForTailCallOptimization(
   MachineFunction &MF = DAG.getMachineFunction();
   const Function *CallerF = MF.getFunction();
   CallingConv::ID CallerCC = CallerF->getCallingConv();
-  // TODO: Handle other calling conventions when they exist
-  if (CalleeCC != CallingConv::C || CallerCC != CallingConv::C)
+  // Interrupt handlers have to return with RETI or RETN themselves.
+  if (CallerF->hasFnAttribute("interrupt"))
     return false;
   LLVMContext &C = *DAG.getContext();
   if (!CCState::resultsCompatible(CalleeCC, CallerCC, MF, C, Ins,
-                                  RetCC_Z80_C, RetCC_Z80_C))
+                                  getRetCCAssignFn(CalleeCC),
+                                  getRetCCAssignFn(CallerCC)))
+    return false;
+  // The callee returns straight to our caller, so it has to preserve at least
+  // the registers that our caller expects us to.
+  const TargetRegisterInfo *TRI = Subtarget.getRegisterInfo();
+  if (CalleeCC != CallerCC &&
+      !TRI->regmaskSubsetEqual(TRI->getCallPreservedMask(MF, CallerCC),
+                               TRI->getCallPreservedMask(MF, CalleeCC)))
     return false;
   // If the callee takes no arguments then go on to check the results of the
   // call.
-  if (!Outs.empty()) {
-    // Check if stack adjustment is needed. For now, do not do this if any
-    // argument is passed on the stack.
-    SmallVector<CCValAssign, 16> ArgLocs;
-    CCState CCInfo(CalleeCC, isVarArg, MF, ArgLocs, C);
-    CCInfo.AnalyzeCallOperands(Outs, getCCAssignFn(CalleeCC));
-    if (CCInfo.getNextStackOffset()) {
-      // Check if the arguments are already laid out in the right way as
-      // the caller's fixed stack objects.
-      MachineFrameInfo &MFI = MF.getFrameInfo();
-      const MachineRegisterInfo *MRI = &MF.getRegInfo();
-      const TargetInstrInfo *TII = Subtarget.getInstrInfo();
-      for (unsigned i = 0, e = ArgLocs.size(); i != e; ++i) {
-        CCValAssign &VA = ArgLocs[i];
-        SDValue Arg = OutVals[i];
-        ISD::ArgFlagsTy Flags = Outs[i].Flags;
-        if (VA.getLocInfo() == CCValAssign::Indirect)
-          return false;
-        if (VA.isMemLoc() && !MatchingStackOffset(Arg, VA.getLocMemOffset(),
-                                                  Flags, MFI, MRI, TII/*, VA*/))
+  if (Outs.empty())
+    return true;
+
+  SmallVector<CCValAssign, 16> ArgLocs;
+  CCState CCInfo(CalleeCC, isVarArg, MF, ArgLocs, C);
+  CCInfo.AnalyzeCallOperands(Outs, getCCAssignFn(CalleeCC));
+  // Our callee saved registers are restored before the jump, which would
+  // overwrite any argument passed in them.
+  const MCPhysReg *CSRegs = TRI->getCalleeSavedRegs(&MF);
+  for (const CCValAssign &VA : ArgLocs)
+    if (VA.isRegLoc())
+      for (const MCPhysReg *CSR = CSRegs; *CSR; ++CSR)
+        if (TRI->regsOverlap(VA.getLocReg(), *CSR))
           return false;
-      }
-    }
+  if (!CCInfo.getNextStackOffset())
+    return true;
+
+  // Stack arguments are written over our own incoming ones, which our caller
+  // pops again, so they have to fit in that area.
+  if (CCInfo.getNextStackOffset() >
+      MF.getInfo<Z80MachineFunctionInfo>()->getArgumentStackSize())
+    return false;
+  bool ArgsMutable =
+      MF.getInfo<Z80MachineFunctionInfo>()->getArgumentsMutable();
+  MachineFrameInfo &MFI = MF.getFrameInfo();
+  const MachineRegisterInfo *MRI = &MF.getRegInfo();
+  const TargetInstrInfo *TII = Subtarget.getInstrInfo();
+  for (unsigned i = 0, e = ArgLocs.size(); i != e; ++i) {
+    CCValAssign &VA = ArgLocs[i];
+    if (VA.getLocInfo() == CCValAssign::Indirect)
+      return false;
+    // Anything but a byval argument that is already in place can be stored,
+    // as long as our incoming arguments weren't made immutable.
+    if (VA.isMemLoc() && (!ArgsMutable || Outs[i].Flags.isByVal()) &&
+        !MatchingStackOffset(OutVals[i], VA.getLocMemOffset(), Outs[i].Flags,
+                             MFI, MRI, TII))
+      return false;
   }
   return true;
 }
@@ -2143,6 +3218,11 @@ SDValue Z80TargetLowering::LowerFormalArguments(
   SmallVector<CCValAssign, 16> ArgLocs;
   CCState CCInfo(CallConv, IsVarArg, MF, ArgLocs, *DAG.getContext());
   CCInfo.AnalyzeFormalArguments(Ins, getCCAssignFn(CallConv));
+  FuncInfo->setArgumentStackSize(CCInfo.getNextStackOffset());
+  // Tail calls may store their stack arguments over ours, so they are only
+  // mutable if there is a tail call that could do so.
+  bool ArgsMutable = hasTailCallSite(*MF.getFunction());
+  FuncInfo->setArgumentsMutable(ArgsMutable);
 
   // If the function takes variable number of arguments, make a frame index for
   // the start of the first vararg value... for expansion of llvm.va_start. We
@@ -2155,7 +3235,7 @@ SDValue Z80TargetLowering::LowerFormalArguments(
   for (unsigned I = 0, E = ArgLocs.size(); I != E; ++I) {
     CCValAssign &VA = ArgLocs[I];
     int FI = MFI.CreateFixedObject(VA.getLocVT().getStoreSize(),
-                                   VA.getLocMemOffset(), true);
+                                   VA.getLocMemOffset(), !ArgsMutable);
     SDValue Val = DAG.getLoad(
         VA.getLocInfo() == CCValAssign::AExt ? VA.getValVT() : VA.getLocVT(),
         DL, Chain, DAG.getFrameIndex(FI, getPointerTy(DAG.getDataLayout())),
@@ -2200,8 +3280,13 @@ const char *Z80TargetLowering::getTargetNodeName(unsigned Opcode) const {
   case Z80ISD::OR:           return "Z80ISD::OR";
   case Z80ISD::CP:           return "Z80ISD::CP";
   case Z80ISD::TST:          return "Z80ISD::TST";
+  case Z80ISD::BIT:          return "Z80ISD::BIT";
   case Z80ISD::MLT:          return "Z80ISD::MLT";
   case Z80ISD::SEXT:         return "Z80ISD::SEXT";
+  case Z80ISD::MBASE:        return "Z80ISD::MBASE";
+  case Z80ISD::DAA:          return "Z80ISD::DAA";
+  case Z80ISD::IN:           return "Z80ISD::IN";
+  case Z80ISD::OUT:          return "Z80ISD::OUT";
   case Z80ISD::CALL:         return "Z80ISD::CALL";
   case Z80ISD::RET_FLAG:     return "Z80ISD::RET_FLAG";
   case Z80ISD::RETN_FLAG:    return "Z80ISD::RETN_FLAG";
@@ -2221,3 +3306,87 @@ EVT Z80TargetLowering::getSetCCResultType(const DataLayout &DL,
   assert(!VT.isVector() && "No default SetCC type for vectors!");
   return MVT::i8;
 }
+
+/// Inline asm constraints.  The register letters name an 8-bit register, or
+/// the pair it starts when used with a wider operand: b for bc, d for de and h
+/// for hl.  x and y are the index registers, q is any register that isn't part
+/// of an index register and w is either index register.  y is unavailable
+/// while IY is the small data base.
+Z80TargetLowering::ConstraintType
+Z80TargetLowering::getConstraintType(StringRef Constraint) const {
+  if (Constraint.size() == 1) {
+    switch (Constraint[0]) {
+    default: break;
+    case 'a': case 'b': case 'c': case 'd': case 'e': case 'h': case 'l':
+    case 'x': case 'y':
+      return C_Register;
+    case 'q': case 'w':
+      return C_RegisterClass;
+    }
+  }
+  return TargetLowering::getConstraintType(Constraint);
+}
+
+std::pair<unsigned, const TargetRegisterClass *>
+Z80TargetLowering::getRegForInlineAsmConstraint(const TargetRegisterInfo *TRI,
+                                                StringRef Constraint,
+                                                MVT VT) const {
+  if (Constraint.size() == 1) {
+    auto Pick = [&](unsigned Reg8, unsigned Reg16, unsigned Reg24,
+                    const TargetRegisterClass *RC8,
+                    const TargetRegisterClass *RC16,
+                    const TargetRegisterClass *RC24)
+        -> std::pair<unsigned, const TargetRegisterClass *> {
+      switch (VT.SimpleTy) {
+      default:        return std::make_pair(0U, nullptr);
+      case MVT::i8:   return std::make_pair(Reg8, RC8);
+      case MVT::i16:  return std::make_pair(Reg16, RC16);
+      case MVT::i24:
+        if (!Subtarget.is24Bit())
+          return std::make_pair(0U, nullptr);
+        return std::make_pair(Reg24, RC24);
+      }
+    };
+    switch (Constraint[0]) {
+    default: break;
+    case 'a':
+      return Pick(Z80::A, 0, 0, &Z80::G8RegClass, nullptr, nullptr);
+    case 'b':
+      return Pick(Z80::B, Z80::BC, Z80::UBC, &Z80::G8RegClass,
+                  &Z80::O16RegClass, &Z80::O24RegClass);
+    case 'c':
+      return Pick(Z80::C, 0, 0, &Z80::G8RegClass, nullptr, nullptr);
+    case 'd':
+      return Pick(Z80::D, Z80::DE, Z80::UDE, &Z80::G8RegClass,
+                  &Z80::O16RegClass, &Z80::O24RegClass);
+    case 'e':
+      return Pick(Z80::E, 0, 0, &Z80::G8RegClass, nullptr, nullptr);
+    case 'h':
+      return Pick(Z80::H, Z80::HL, Z80::UHL, &Z80::G8RegClass,
+                  &Z80::G16RegClass, &Z80::G24RegClass);
+    case 'l':
+      return Pick(Z80::L, 0, 0, &Z80::G8RegClass, nullptr, nullptr);
+    case 'x':
+      return Pick(0, Z80::IX, Z80::UIX, nullptr,
+                  &Z80::I16RegClass, &Z80::I24RegClass);
+    case 'y':
+      // IY holds the small data base, which the asm must not change.
+      if (Z80TargetObjectFile::hasSmallData())
+        return std::make_pair(0U, nullptr);
+      return Pick(0, Z80::IY, Z80::UIY, nullptr,
+                  &Z80::I16RegClass, &Z80::I24RegClass);
+    case 'q':
+      return Pick(0, 0, 0, &Z80::G8RegClass,
+                  &Z80::G16RegClass, &Z80::G24RegClass);
+    case 'w':
+      return Pick(0, 0, 0, Subtarget.hasIndexHalfRegs() ? &Z80::I8RegClass
+                                                        : nullptr,
+                  &Z80::I16RegClass, &Z80::I24RegClass);
+    case 'r':
+      return Pick(0, 0, 0, Subtarget.hasIndexHalfRegs() ? &Z80::R8RegClass
+                                                        : &Z80::G8RegClass,
+                  &Z80::R16RegClass, &Z80::R24RegClass);
+    }
+  }
+  return TargetLowering::getRegForInlineAsmConstraint(TRI, Constraint, VT);
+}
@@ -22,6 +22,16 @@ namespace llvm {
 class Z80Subtarget;
 class Z80TargetMachine;
 
+namespace Z80AS {
+/// Address spaces, matching the data layout.
+enum : unsigned {
+  Default = 0, ///< Pointers of the current mode.
+  IO      = 1, ///< I/O port addresses.
+  Short   = 2  ///< On eZ80, pointers of the other mode.  In ADL mode these are
+               ///< 16-bit pointers relative to MBASE.
+};
+} // end Z80AS namespace
+
 namespace Z80ISD {
 // Z80 Specific DAG Nodes
 enum NodeType : unsigned {
@@ -41,11 +51,25 @@ enum NodeType : unsigned {
   /// Z80 compare and test
   CP, TST,
 
+  /// Test a single bit of a byte, setting Z if it is clear.  Takes the byte
+  /// and the bit number.
+  BIT,
+
   MLT,
 
   /// This produces an all zeros/ones value from an input carry (SBC r,r).
   SEXT,
 
+  /// Reads the eZ80 MBASE register (LD A,MB).
+  MBASE,
+
+  /// Decimal adjust after an addition or subtraction, with flags.
+  DAA,
+
+  /// Port I/O.  IN takes a chain and a 16-bit port and produces a byte and a
+  /// chain.  OUT takes a chain, a byte and a 16-bit port.
+  IN, OUT,
+
   /// This operation represents an abstract Z80 call instruction, which
   /// includes a bunch of information.
   CALL,
@@ -101,24 +125,42 @@ public:
   SDValue LowerAddSub(SDValue Op, SelectionDAG &DAG) const;
   SDValue LowerBitwise(SDValue Op, SelectionDAG &DAG) const;
   SDValue LowerShift(SDValue Op, SelectionDAG &DAG) const;
+  SDValue ExpandShift32(SDNode *N, SelectionDAG &DAG) const;
+  SDValue ExpandFPSign(SDNode *N, SelectionDAG &DAG) const;
+  SDValue LowerFPCmpZero(SDValue Op, SelectionDAG &DAG) const;
+  SDValue EmitI64LibCall(RTLIB::Libcall LC, MVT RetVT, SDValue LHS,
+                         SDValue RHS, const SDLoc &DL,
+                         SelectionDAG &DAG) const;
+  SDValue ExpandI64(SDNode *N, SelectionDAG &DAG) const;
+  SDValue LowerI64Cmp(SDValue Op, SelectionDAG &DAG) const;
   SDValue LowerSignExtend(SDValue Op, SelectionDAG &DAG) const;
   SDValue LowerMul(SDValue Op, SelectionDAG &DAG) const;
   SDValue LowerLoad(LoadSDNode *Node, SelectionDAG &DAG) const;
   SDValue LowerStore(StoreSDNode *Node, SelectionDAG &DAG) const;
+  SDValue LowerAddrSpaceCast(SDValue Op, SelectionDAG &DAG) const;
+  SDValue LowerINTRINSIC_WO_CHAIN(SDValue Op, SelectionDAG &DAG) const;
+  SDValue LowerINTRINSIC_W_CHAIN(SDValue Op, SelectionDAG &DAG) const;
+  SDValue LowerINTRINSIC_VOID(SDValue Op, SelectionDAG &DAG) const;
   SDValue LowerVAStart(SDValue Op, SelectionDAG &DAG) const;
   SDValue LowerOperation(SDValue Op, SelectionDAG &DAG) const override;
 
   /// ---------------------------------------------------------------------- ///
 
   bool useSoftFloat() const override { return true; }
-  bool isSelectSupported(SelectSupportKind /*Kind*/) const override {
-    return false;
+  bool isSelectSupported(SelectSupportKind Kind) const override {
+    return Kind == ScalarValSelect;
   }
   bool canOpTrap(unsigned Op, EVT VT) const override { return false; }
 
   /// This method returs the name of a target specific DAG node.
   const char *getTargetNodeName(unsigned Opcode) const override;
 
+  /// Inline asm support.
+  ConstraintType getConstraintType(StringRef Constraint) const override;
+  std::pair<unsigned, const TargetRegisterClass *>
+  getRegForInlineAsmConstraint(const TargetRegisterInfo *TRI,
+                               StringRef Constraint, MVT VT) const override;
+
   /// Return the value type to use for ISD::SETCC.
   EVT getSetCCResultType(const DataLayout &DL, LLVMContext &Context,
                          EVT VT) const override;
@@ -137,6 +179,18 @@ public:
   bool isLegalAddressingMode(const DataLayout &DL, const AddrMode &AM,
                              Type *Ty, unsigned AS) const override;
 
+  /// Return true and the base pointer, offset and addressing mode if the
+  /// node's address can be legally represented as a pre-decrement access.
+  bool getPreIndexedAddressParts(SDNode *N, SDValue &Base, SDValue &Offset,
+                                 ISD::MemIndexedMode &AM,
+                                 SelectionDAG &DAG) const override;
+
+  /// Return true and the base pointer, offset and addressing mode if Op can
+  /// be combined with the node to form a post-increment access.
+  bool getPostIndexedAddressParts(SDNode *N, SDNode *Op, SDValue &Base,
+                                  SDValue &Offset, ISD::MemIndexedMode &AM,
+                                  SelectionDAG &DAG) const override;
+
   /// Return true if the specified immediate is a legal icmp immediate, that is
   /// the target has icmp instructions which can compare a register against the
   /// immediate without having to materialize the immediate into a register.
@@ -218,6 +272,12 @@ public:
   SDValue EmitPair(const SDLoc &DL, SDValue Hi, SDValue Lo,
                    SelectionDAG &DAG) const;
   SDValue EmitSignToCarry(SDValue Op, SelectionDAG &DAG) const;
+  SDValue EmitCarrySelect(const SDLoc &DL, EVT VT, SDValue TV, SDValue FV,
+                          SDValue Flags, SelectionDAG &DAG) const;
+  SDValue EmitMBaseExtend(const SDLoc &DL, SDValue Ptr,
+                          SelectionDAG &DAG) const;
+  SDValue combineShortPtrAccess(LSBaseSDNode *N, SelectionDAG &DAG) const;
+  SDValue combinePortAccess(LSBaseSDNode *N, DAGCombinerInfo &DCI) const;
   // Legalize Helpers
   SDValue EmitCmp(SDValue LHS, SDValue RHS, SDValue &TargetCC,
                   ISD::CondCode CC, const SDLoc &DL, SelectionDAG &DAG) const;
@@ -289,6 +349,8 @@ public:
                                        MachineBasicBlock *BB) const;
   MachineBasicBlock *EmitLoweredSExt(MachineInstr &MI,
                                      MachineBasicBlock *BB) const;
+  MachineBasicBlock *EmitLoweredPortLoop(MachineInstr &MI,
+                                         MachineBasicBlock *BB) const;
 
   SDValue combineCopyFromReg(SDNode *N, DAGCombinerInfo &DCI) const;
   SDValue combineStore(StoreSDNode *N, DAGCombinerInfo &DCI) const;
@@ -13,10 +13,12 @@
 
 #include "Z80InstrInfo.h"
 #include "Z80.h"
+#include "Z80MachineFunctionInfo.h"
 #include "Z80Subtarget.h"
 #include "llvm/CodeGen/MachineFrameInfo.h"
 #include "llvm/CodeGen/MachineInstrBuilder.h"
 #include "llvm/CodeGen/MachineRegisterInfo.h"
+#include "llvm/IR/Module.h"
 #include "llvm/MC/MCExpr.h"
 #include "llvm/MC/MCInst.h"
 using namespace llvm;
@@ -396,18 +398,22 @@ void Z80InstrInfo::copyPhysReg(MachineBasicBlock &MBB,
           .addReg(SrcReg, getKillRegState(KillSrc));
       } else {
         // We are copying between different index registers, so we need to use
-        // an intermediate register.
-        BuildMI(MBB, MI, DL, get(Subtarget.is24Bit() ? Z80::PUSH24r
-                                                     : Z80::PUSH16r))
-          .addReg(Z80::AF);
+        // an intermediate register.  Only save A if it is live.
+        bool SaveA = MBB.computeRegisterLiveness(&RI, Z80::A, MI) !=
+                     MachineBasicBlock::LQR_Dead;
+        if (SaveA)
+          BuildMI(MBB, MI, DL, get(Subtarget.is24Bit() ? Z80::PUSH24r
+                                                       : Z80::PUSH16r))
+            .addReg(Z80::AF);
         BuildMI(MBB, MI, DL, get(Z80::X8RegClass.contains(SrcReg) ? Z80::LD8xx
                                                                   : Z80::LD8yy),
                 Z80::A).addReg(SrcReg, getKillRegState(KillSrc));
         BuildMI(MBB, MI, DL, get(Z80::X8RegClass.contains(DstReg) ? Z80::LD8xx
                                                                   : Z80::LD8yy),
-                DstReg).addReg(Z80::A);
-        BuildMI(MBB, MI, DL, get(Subtarget.is24Bit() ? Z80::POP24r
-                                                     : Z80::POP16r), Z80::AF);
+                DstReg).addReg(Z80::A, getKillRegState(!SaveA));
+        if (SaveA)
+          BuildMI(MBB, MI, DL, get(Subtarget.is24Bit() ? Z80::POP24r
+                                                       : Z80::POP16r), Z80::AF);
       }
     } else {
       assert(Subtarget.hasIndexHalfRegs() && "Need  index half registers");
@@ -504,8 +510,8 @@ void Z80InstrInfo::copyPhysReg(MachineBasicBlock &MBB,
   // - We don't have undocumented half index copies
   bool IsDstIndexReg = Z80::I16RegClass.contains(DstReg) || Z80::I24RegClass.contains(DstReg);
   unsigned NumIndexRegs = IsSrcIndexReg + IsDstIndexReg;
-  bool OptSize = MBB.getParent()->getFunction()->getAttributes()
-    .hasAttribute(AttributeList::FunctionIndex, Attribute::OptimizeForSize);
+  bool OptSize = MBB.getParent()->getInfo<Z80MachineFunctionInfo>()
+    ->shouldOptForSize(&MBB);
   if (Is24Bit || (NumIndexRegs == 1 && OptSize) ||
       (NumIndexRegs && !Subtarget.hasIndexHalfRegs())) {
     BuildMI(MBB, MI, DL, get(Is24Bit ? Z80::PUSH24r : Z80::PUSH16r))
@@ -563,8 +569,16 @@ void Z80InstrInfo::copyPhysReg(MachineBasicBlock &MBB,
   } else*/ {
     // If SrcLoDstHiOverlap then copy out SrcLo before SrcHi overwrites it,
     // otherwise the order doesn't matter.
+    MachineInstr *Prev = MI == MBB.begin() ? nullptr : &*std::prev(MI);
     copyPhysReg(MBB, MI, DL, DstLoReg, SrcLoReg, KillSrc);
     copyPhysReg(MBB, MI, DL, DstHiReg, SrcHiReg, KillSrc);
+    // With subregister liveness only one half of SrcReg may be defined, so
+    // make each half copy read the whole register, which is live.
+    for (auto I = Prev ? std::next(Prev->getIterator()) : MBB.begin(); I != MI;
+         ++I)
+      if (I->readsRegister(SrcLoReg, &RI) || I->readsRegister(SrcHiReg, &RI))
+        MachineInstrBuilder(*MBB.getParent(), *I)
+          .addReg(SrcReg, RegState::Implicit);
   }
   --MI;
   MI->addRegisterDefined(DstReg, &RI);
@@ -769,10 +783,7 @@ bool Z80InstrInfo::expandPostRAPseudo(MachineInstr &MI) const {
   MachineFunction &MF = *MBB.getParent();
   auto Next = ++MachineBasicBlock::iterator(MI);
   MachineInstrBuilder MIB(MF, MI);
-  const TargetRegisterInfo &TRI = getRegisterInfo();
   bool Is24Bit = Subtarget.is24Bit();
-  bool UseLEA = Is24Bit && !MF.getFunction()->getAttributes()
-    .hasAttribute(AttributeList::FunctionIndex, Attribute::OptimizeForSize);
   DEBUG(dbgs() << "\nZ80InstrInfo::expandPostRAPseudo:"; MI.dump());
   switch (unsigned Opc = MI.getOpcode()) {
   default:
@@ -808,35 +819,6 @@ bool Z80InstrInfo::expandPostRAPseudo(MachineInstr &MI) const {
         ->ChangeToImmediate(Opc == Z80::LD24r0 ? 0 : -1);
     }
     break;
-  case Z80::CP16ao:
-  case Z80::CP24ao: {
-    unsigned Reg = Opc == Z80::CP24ao ? Z80::UHL : Z80::HL;
-    if (MBB.computeRegisterLiveness(&TRI, Reg, Next) !=
-        MachineBasicBlock::LQR_Dead) {
-      BuildMI(MBB, Next, DL, get(Opc == Z80::CP24ao ? Z80::ADD24ao
-                                 : Z80::ADD16ao), Reg)
-        .addReg(Reg).add(MI.getOperand(0));
-      MI.getOperand(0).setIsKill(false);
-    }
-    LLVM_FALLTHROUGH;
-  }
-  case Z80::SUB16ao:
-  case Z80::SUB24ao:
-    expandPostRAPseudo(*BuildMI(MBB, MI, DL, get(Z80::RCF)));
-    MI.setDesc(get(Opc == Z80::CP24ao || Opc == Z80::SUB24ao ? Z80::SBC24ao
-                                                             : Z80::SBC16ao));
-    break;
-  case Z80::CP16a0:
-  case Z80::CP24a0: {
-    unsigned Reg = Opc == Z80::CP24a0 ? Z80::UHL : Z80::HL;
-    unsigned UndefReg = Opc == Z80::CP24a0 ? Z80::UBC : Z80::BC;
-    BuildMI(MBB, MI, DL, get(Opc == Z80::CP24a0 ? Z80::ADD24ao : Z80::ADD16ao),
-            Reg).addReg(Reg).addReg(UndefReg, RegState::Undef);
-    expandPostRAPseudo(*BuildMI(MBB, MI, DL, get(Z80::RCF)));
-    MI.setDesc(get(Opc == Z80::CP24a0 ? Z80::SBC24ao : Z80::SBC16ao));
-    MIB.addReg(UndefReg, RegState::Undef);
-    break;
-  }
   case Z80::LD8ro:
   case Z80::LD8rp: {
     MachineOperand &DstOp = MI.getOperand(0);
@@ -850,53 +832,6 @@ bool Z80InstrInfo::expandPostRAPseudo(MachineInstr &MI) const {
     MI.setDesc(get(Opc == Z80::LD8ro ? Z80::LD8go : Z80::LD8gp));
     break;
   }
-  case Z80::LD88rp:
-  case Z80::LD88ro: {
-    assert(!Subtarget.has16BitEZ80Ops() &&
-           "LD88rp/LD88ro is not used on the ez80 in 16-bit mode");
-    unsigned NewOpc = Opc == Z80::LD88rp ? Z80::LD8rp : Z80::LD8ro;
-    MachineOperand &DstOp = MI.getOperand(0);
-    const MachineOperand &AddrOp = MI.getOperand(1);
-    unsigned OrigReg = DstOp.getReg();
-    unsigned Reg = OrigReg;
-    bool Index = Z80::I16RegClass.contains(Reg);
-    bool Overlap = NewOpc == Z80::LD8rp && Reg == Z80::HL;
-    unsigned ScratchReg;
-    if (Index || Overlap) {
-      Reg = Index ? Z80::HL : Z80::DE;
-      ScratchReg = Is24Bit ? Index ? Z80::UHL : Z80::UDE : Reg;
-      BuildMI(MBB, MI, DL, get(Is24Bit ? Z80::PUSH24r : Z80::PUSH16r))
-        .addReg(ScratchReg, RegState::Undef);
-    }
-    MIB = BuildMI(MBB, MI, DL, get(NewOpc), TRI.getSubReg(Reg, Z80::sub_low))
-      .addReg(AddrOp.getReg());
-    if (NewOpc == Z80::LD8rp)
-      BuildMI(MBB, MI, DL, get(Is24Bit ? Z80::INC24r : Z80::INC16r),
-              AddrOp.getReg()).addReg(AddrOp.getReg());
-    MI.setDesc(get(NewOpc));
-    DstOp.setReg(TRI.getSubReg(Reg, Z80::sub_high));
-    if (NewOpc == Z80::LD8ro) {
-      MachineOperand &OffOp = MI.getOperand(2);
-      MIB.addImm(OffOp.getImm());
-      OffOp.setImm(OffOp.getImm() + 1);
-    } else if (!AddrOp.isKill())
-      BuildMI(MBB, Next, DL, get(Is24Bit ? Z80::DEC24r : Z80::DEC16r),
-              AddrOp.getReg()).addReg(AddrOp.getReg());
-    if (Index)
-      BuildMI(MBB, Next, DL, get(Is24Bit ? Z80::EX24SP : Z80::EX16SP),
-              ScratchReg).addReg(ScratchReg);
-    else if (Overlap)
-      copyPhysReg(MBB, Next, DL, AddrOp.getReg(), ScratchReg, true);
-    if (Index || Overlap)
-      BuildMI(MBB, Next, DL, get(Is24Bit ? Z80::POP24r : Z80::POP16r),
-              Overlap ? ScratchReg : Is24Bit ?
-                  TRI.getMatchingSuperReg(OrigReg, Z80::sub_short,
-                                          &Z80::R24RegClass) : OrigReg);
-    expandPostRAPseudo(*MIB);
-    expandPostRAPseudo(MI);
-    DEBUG(MI.dump());
-    break;
-  }
   case Z80::LD8or:
   case Z80::LD8pr: {
     MachineOperand &SrcOp = MI.getOperand(MI.getNumExplicitOperands() - 1);
@@ -911,61 +846,6 @@ bool Z80InstrInfo::expandPostRAPseudo(MachineInstr &MI) const {
     MI.setDesc(get(Opc == Z80::LD8or ? Z80::LD8og : Z80::LD8pg));
     break;
   }
-  case Z80::LD88pr:
-  case Z80::LD88or: {
-    assert(!Subtarget.has16BitEZ80Ops() &&
-           "LD88pr/LD88or is not used on the ez80 in 16-bit mode");
-    unsigned NewOpc = Opc == Z80::LD88pr ? Z80::LD8pr : Z80::LD8or;
-    const MachineOperand &AddrOp = MI.getOperand(0);
-    MachineOperand &SrcOp = MI.getOperand(MI.getNumExplicitOperands() - 1);
-    unsigned Reg = SrcOp.getReg();
-    bool Index = Z80::I16RegClass.contains(Reg);
-    bool Overlap = NewOpc == Z80::LD8pr && Reg == Z80::HL;
-    unsigned ScratchReg;
-    if (Index || Overlap) {
-      unsigned SuperReg = TRI.getMatchingSuperReg(Reg, Z80::sub_short,
-                                                  &Z80::R24RegClass);
-      ScratchReg = Index ? Is24Bit ? Z80::UHL : Z80::HL : Z80::AF;
-      BuildMI(MBB, MI, DL, get(Is24Bit ? Z80::PUSH24r : Z80::PUSH16r))
-        .addReg(UseLEA || Overlap ? ScratchReg : Is24Bit ? SuperReg : Reg,
-                RegState::Undef);
-      if (Index) {
-        if (UseLEA)
-          BuildMI(MBB, MI, DL, get(Z80::LEA24ro), Z80::UHL)
-            .addReg(SuperReg).addImm(0);
-        else
-          BuildMI(MBB, MI, DL, get(Is24Bit ? Z80::EX24SP : Z80::EX16SP),
-                  ScratchReg).addReg(ScratchReg);
-      }
-      Reg = Z80::HL;
-    }
-    MIB = BuildMI(MBB, MI, DL, get(NewOpc)).addReg(AddrOp.getReg());
-    if (NewOpc == Z80::LD8or) {
-      MachineOperand &OffOp = MI.getOperand(1);
-      MIB.addImm(OffOp.getImm());
-      OffOp.setImm(OffOp.getImm() + 1);
-    } else if (!AddrOp.isKill())
-      BuildMI(MBB, Next, DL, get(Is24Bit ? Z80::DEC24r : Z80::DEC16r),
-              AddrOp.getReg()).addReg(AddrOp.getReg());
-    MIB.addReg(TRI.getSubReg(Reg, Z80::sub_low));
-    Reg = TRI.getSubReg(Reg, Z80::sub_high);
-    if (Overlap) {
-      copyPhysReg(MBB, MI, DL, Z80::A, Reg, false);
-      Reg = Z80::A;
-    }
-    if (NewOpc == Z80::LD8pr)
-      BuildMI(MBB, MI, DL, get(Is24Bit ? Z80::INC24r : Z80::INC16r),
-              AddrOp.getReg()).addReg(AddrOp.getReg());
-    MI.setDesc(get(NewOpc));
-    SrcOp.setReg(Reg);
-    if (Index || Overlap)
-      BuildMI(MBB, Next, DL, get(Is24Bit ? Z80::POP24r : Z80::POP16r),
-              ScratchReg);
-    expandPostRAPseudo(*MIB);
-    expandPostRAPseudo(MI);
-    DEBUG(MI.dump());
-    break;
-  }
   case Z80::LD16rm:
     expandLoadStoreWord(&Z80::A16RegClass, Z80::LD16am,
                         &Z80::O16RegClass, Z80::LD16om, MI, 0);
@@ -1023,7 +903,7 @@ bool Z80InstrInfo::analyzeCompare(const MachineInstr &MI,
   default: return false;
   case Z80::OR8ar:
     SrcReg = Z80::A;
-    if (MI.getOperand(1).getReg() != SrcReg)
+    if (MI.getOperand(0).getReg() != SrcReg)
       return false;
     // Compare against zero.
     SrcReg2 = 0;
@@ -1053,6 +933,25 @@ bool Z80InstrInfo::analyzeCompare(const MachineInstr &MI,
     SrcReg = Z80::A;
     SrcReg2 = CmpMask = CmpValue = 0;
     break;
+  case Z80::CP16a0:
+  case Z80::CP24a0:
+    SrcReg = MI.getOpcode() == Z80::CP24a0 ? Z80::UHL : Z80::HL;
+    SrcReg2 = 0;
+    CmpMask = ~0;
+    CmpValue = 0;
+    break;
+  case Z80::CP16ao:
+  case Z80::SUB16ao:
+    SrcReg = Z80::HL;
+    SrcReg2 = MI.getOperand(0).getReg();
+    CmpMask = CmpValue = 0;
+    break;
+  case Z80::CP24ao:
+  case Z80::SUB24ao:
+    SrcReg = Z80::UHL;
+    SrcReg2 = MI.getOperand(0).getReg();
+    CmpMask = CmpValue = 0;
+    break;
   }
   MachineBasicBlock::const_reverse_iterator I = MI, E = MI.getParent()->rend();
   while (++I != E && I->isFullCopy())
@@ -1063,52 +962,133 @@ bool Z80InstrInfo::analyzeCompare(const MachineInstr &MI,
   return true;
 }
 
-/// Check whether the first instruction, whose only purpose is to update flags,
-/// can be made redundant. CP8ar is made redundant by SUB8ar if the operands are
-/// the same.
-/// SrcReg, SrcReg2: register operands for FlagI.
-/// ImmValue: immediate for FlagI if it takes an immediate.
-inline static bool isRedundantFlagInstr(MachineInstr &FI, unsigned SrcReg,
-                                        unsigned SrcReg2, int ImmMask,
-                                        int ImmValue, MachineInstr &OI) {
-  if (ImmMask)
-    return (FI.getOpcode() == Z80::CP8ai && OI.getOpcode() == Z80::SUB8ai) &&
-      OI.getOperand(1).getImm() == ImmValue;
-  else
-    return (FI.getOpcode() == Z80::CP8ar && OI.getOpcode() == Z80::SUB8ar) &&
-      OI.getOperand(1).getReg() == SrcReg2;
+namespace {
+/// Flags tracked when deciding whether a compare is redundant.
+enum : unsigned {
+  FlagS = 1 << 0,
+  FlagZ = 1 << 1,
+  FlagC = 1 << 2,
+  FlagPV = 1 << 3,
+  AllFlags = FlagS | FlagZ | FlagC | FlagPV,
+  /// Read by an instruction that may depend on any flag, including H and N,
+  /// so only an identical compare can provide it.
+  FlagUnknown = 1 << 4
+};
+} // end anonymous namespace
+
+/// Return the width in bits of the values compared by CmpInstr.
+static unsigned getCompareWidth(const MachineInstr &CmpInstr) {
+  switch (CmpInstr.getOpcode()) {
+  default: return 8;
+  case Z80::CP16a0: case Z80::CP16ao: case Z80::SUB16ao: return 16;
+  case Z80::CP24a0: case Z80::CP24ao: case Z80::SUB24ao: return 24;
+  }
 }
 
-/// Check whether the instruction sets the sign and zero flag based on its
-/// result.
-inline static bool isSZSettingInstr(MachineInstr &MI) {
+/// Return the flags that MI leaves set from its result of Width bits the same
+/// way that OR A,A would for a byte.  That is S and Z, carry clear and parity
+/// in P/V.  A wider compare with zero leaves P/V clear instead.
+static unsigned getResultFlags(const MachineInstr &MI, unsigned &Width) {
+  Width = 8;
   switch (MI.getOpcode()) {
-  default: return false;
-  case Z80::INC8r:  case Z80::INC8p:  case Z80::INC8o:
-  case Z80::DEC8r:  case Z80::DEC8p:  case Z80::DEC8o:
+  default: return 0;
+  // Logical operations match exactly.
+  case Z80::AND8ar: case Z80::AND8ai: case Z80::AND8ap: case Z80::AND8ao:
+  case Z80::XOR8ar: case Z80::XOR8ai: case Z80::XOR8ap: case Z80::XOR8ao:
+  case Z80:: OR8ar: case Z80:: OR8ai: case Z80:: OR8ap: case Z80:: OR8ao:
+    return AllFlags;
+  // Shifts and rotates set parity, but carry holds the bit shifted out.
+  case Z80::RLC8r: case Z80::RRC8r: case Z80::RL8r: case Z80::RR8r:
+  case Z80::SLA8r: case Z80::SRA8r: case Z80::SRL8r:
+    return FlagS | FlagZ | FlagPV;
+  // Arithmetic sets carry and overflow from the operation, and INC and DEC
+  // don't change carry at all.
+  case Z80::INC8r:  case Z80::DEC8r:  case Z80::NEG:
   case Z80::ADD8ar: case Z80::ADD8ai: case Z80::ADD8ap: case Z80::ADD8ao:
   case Z80::ADC8ar: case Z80::ADC8ai: case Z80::ADC8ap: case Z80::ADC8ao:
   case Z80::SUB8ar: case Z80::SUB8ai: case Z80::SUB8ap: case Z80::SUB8ao:
   case Z80::SBC8ar: case Z80::SBC8ai: case Z80::SBC8ap: case Z80::SBC8ao:
-  case Z80::AND8ar: case Z80::AND8ai: case Z80::AND8ap: case Z80::AND8ao:
-  case Z80::XOR8ar: case Z80::XOR8ai: case Z80::XOR8ap: case Z80::XOR8ao:
-  case Z80:: OR8ar: case Z80:: OR8ai: case Z80:: OR8ap: case Z80:: OR8ao:
-  case Z80::SBC16ao:case Z80::NEG:    case Z80::ADC16ao:
-  case Z80::SUB16ao:case Z80::SUB24ao:
-  case Z80::RLC8r:  case Z80::RLC8p:  case Z80::RLC8o:
-  case Z80::RRC8r:  case Z80::RRC8p:  case Z80::RRC8o:
-  case Z80:: RL8r:  case Z80:: RL8p:  case Z80:: RL8o:
-  case Z80:: RR8r:  case Z80:: RR8p:  case Z80:: RR8o:
-  case Z80::SLA8r:  case Z80::SLA8p:  case Z80::SLA8o:
-  case Z80::SRA8r:  case Z80::SRA8p:  case Z80::SRA8o:
-  case Z80::SRL8r:  case Z80::SRL8p:  case Z80::SRL8o:
-    return true;
+    return FlagS | FlagZ;
+  // Unlike ADD HL,rr and INC/DEC rr, which leave S and Z alone, the word
+  // ADC and SBC set them from the whole result.
+  case Z80::ADC16ao: case Z80::ADC16aa: case Z80::ADC16SP:
+  case Z80::SBC16ao: case Z80::SBC16aa: case Z80::SBC16SP:
+  case Z80::SUB16ao:
+    Width = 16;
+    return FlagS | FlagZ;
+  case Z80::ADC24ao: case Z80::ADC24aa: case Z80::ADC24SP:
+  case Z80::SBC24ao: case Z80::SBC24aa: case Z80::SBC24SP:
+  case Z80::SUB24ao:
+    Width = 24;
+    return FlagS | FlagZ;
   }
 }
 
+/// Return the flags read by MI, conservatively all of them if unknown.
+static unsigned getUsedFlags(const MachineInstr &MI) {
+  unsigned CCIdx;
+  switch (MI.getOpcode()) {
+  default: return AllFlags | FlagUnknown;
+  case Z80::JQCC:
+    CCIdx = 1;
+    break;
+  case Z80::Select8: case Z80::Select16: case Z80::Select24:
+    CCIdx = 3;
+    break;
+  case Z80::ADC8ar: case Z80::ADC8ai: case Z80::ADC8ap: case Z80::ADC8ao:
+  case Z80::SBC8ar: case Z80::SBC8ai: case Z80::SBC8ap: case Z80::SBC8ao:
+  case Z80::ADC16ao: case Z80::ADC16aa: case Z80::ADC16SP:
+  case Z80::SBC16ao: case Z80::SBC16aa: case Z80::SBC16SP:
+  case Z80::ADC24ao: case Z80::ADC24aa: case Z80::ADC24SP:
+  case Z80::SBC24ao: case Z80::SBC24aa: case Z80::SBC24SP:
+  case Z80::RL8r: case Z80::RL8p: case Z80::RL8o:
+  case Z80::RR8r: case Z80::RR8p: case Z80::RR8o:
+  case Z80::SExt8: case Z80::SExt16: case Z80::SExt24:
+    return FlagC;
+  }
+  switch (MI.getOperand(CCIdx).getImm()) {
+  default: return AllFlags;
+  case Z80::COND_NZ: case Z80::COND_Z: return FlagZ;
+  case Z80::COND_NC: case Z80::COND_C: return FlagC;
+  case Z80::COND_PO: case Z80::COND_PE: return FlagPV;
+  case Z80::COND_P: case Z80::COND_M: return FlagS;
+  }
+}
+
+/// Return the flags that OI, an earlier compare or subtract, left the same as
+/// CmpInstr would, given the sources CmpInstr compares.  Operands compared in
+/// the other order only agree on equality.
+unsigned Z80InstrInfo::getRedundantFlags(MachineInstr &CmpInstr,
+                                         unsigned SrcReg, unsigned SrcReg2,
+                                         int CmpMask, int CmpValue,
+                                         MachineInstr &OI) const {
+  unsigned OISrcReg, OISrcReg2;
+  int OIMask, OIValue;
+  if (!analyzeCompare(OI, OISrcReg, OISrcReg2, OIMask, OIValue) ||
+      getCompareWidth(OI) != getCompareWidth(CmpInstr))
+    return 0;
+  // Only virtual registers are known to hold the same value at both points,
+  // and a memory operand may have changed.
+  for (unsigned Reg : {SrcReg, SrcReg2, OISrcReg, OISrcReg2})
+    if (Reg && !TargetRegisterInfo::isVirtualRegister(Reg))
+      return 0;
+  if (!SrcReg2 && !CmpMask)
+    return 0;
+  if (OISrcReg == SrcReg && OISrcReg2 == SrcReg2 &&
+      OIMask == CmpMask && OIValue == CmpValue) {
+    // OR A,A sets parity where CP 0 clears overflow.
+    if ((OI.getOpcode() == Z80::OR8ar) != (CmpInstr.getOpcode() == Z80::OR8ar))
+      return AllFlags & ~FlagPV;
+    return AllFlags | FlagUnknown;
+  }
+  if (SrcReg2 && OISrcReg == SrcReg2 && OISrcReg2 == SrcReg)
+    return FlagZ;
+  return 0;
+}
+
 /// Check if there exists an earlier instruction that operates on the same
-/// source operands and sets flags in the same way as Compare; remove Compare if
-/// possible.
+/// source operands and sets flags in the same way as Compare, or that produced
+/// the value compared with zero; remove Compare if possible.
 bool Z80InstrInfo::optimizeCompareInstr(MachineInstr &CmpInstr,
                                         unsigned SrcReg, unsigned SrcReg2,
                                         int CmpMask, int CmpValue,
@@ -1117,16 +1097,19 @@ bool Z80InstrInfo::optimizeCompareInstr(MachineInstr &CmpInstr,
   bool IsCmpZero = CmpMask && !CmpValue;
 
   // Check whether we can replace SUB with CP.
-  unsigned CpOp;
+  unsigned CpOp, ResultReg = Z80::A;
   switch (CmpInstr.getOpcode()) {
   default: CpOp = 0; break;
   case Z80::SUB8ai: CpOp = IsCmpZero ? Z80::OR8ar : Z80::CP8ai; break;
   case Z80::SUB8ar: CpOp = Z80::CP8ar; break;
   case Z80::SUB8ap: CpOp = Z80::CP8ap; break;
   case Z80::SUB8ao: CpOp = Z80::CP8ao; break;
+  case Z80::SUB16ao: CpOp = Z80::CP16ao; ResultReg = Z80::HL; break;
+  case Z80::SUB24ao: CpOp = Z80::CP24ao; ResultReg = Z80::UHL; break;
   }
   if (CpOp) {
-    int DeadDef = CmpInstr.findRegisterDefOperandIdx(Z80::A, /*isDead*/true);
+    int DeadDef = CmpInstr.findRegisterDefOperandIdx(ResultReg,
+                                                     /*isDead*/true);
     if (DeadDef == -1)
       return false;
     // There is no use of the destination register, so we replace SUB with CP.
@@ -1137,39 +1120,64 @@ bool Z80InstrInfo::optimizeCompareInstr(MachineInstr &CmpInstr,
       CmpInstr.RemoveOperand(DeadDef);
   }
 
-  // Get the unique definition of SrcReg.
-  MachineInstr *MI = MRI->getUniqueVRegDef(SrcReg);
-  if (!MI) return false;
-
-  MachineBasicBlock::iterator I = CmpInstr, Def = MI;
-
   const TargetRegisterInfo *TRI = &getRegisterInfo();
-  for (auto RI = ++Def.getReverse(), RE = MI->getParent()->rend();
-       MI->isFullCopy() && RI != RE; ++RI)
-    if (RI->definesRegister(MI->getOperand(1).getReg(), TRI))
-      MI = &*RI;
-
-  // If MI is not in the same BB as CmpInstr, do not optimize.
-  if (IsCmpZero && (MI->getParent() != CmpInstr.getParent() ||
-                    !isSZSettingInstr(*MI)))
-    return false;
+  MachineBasicBlock &MBB = *CmpInstr.getParent();
+  MachineBasicBlock::iterator I = CmpInstr;
 
-  // We are searching for an earlier instruction, which will be stored in
-  // SubInstr, that can make CmpInstr redundant.
-  MachineInstr *SubInstr = nullptr;
+  // Scan forward from the instruction after CmpInstr for uses of F, gathering
+  // which flags they need.  Stop once F is redefined or killed, otherwise F may
+  // be live-out.
+  unsigned UsedFlags = 0;
+  bool IsSafe = false;
+  for (auto J = std::next(I), E = MBB.end(); J != E; ++J) {
+    const MachineInstr &Instr = *J;
+    if (Instr.readsRegister(Z80::F, TRI))
+      UsedFlags |= getUsedFlags(Instr);
+    if (Instr.modifiesRegister(Z80::F, TRI) ||
+        Instr.killsRegister(Z80::F, TRI)) {
+      IsSafe = true;
+      break;
+    }
+  }
+  if (!IsSafe)
+    for (MachineBasicBlock *Successor : MBB.successors())
+      if (Successor->isLiveIn(Z80::F))
+        UsedFlags = AllFlags | FlagUnknown;
+
+  // Find the instruction producing the value compared with zero, looking
+  // through copies, which is where the flags will come from instead.
+  MachineInstr *MI = nullptr;
+  if (IsCmpZero && TargetRegisterInfo::isVirtualRegister(SrcReg))
+    MI = MRI->getUniqueVRegDef(SrcReg);
+  if (MI) {
+    MachineBasicBlock::iterator Def = MI;
+    for (auto RI = ++Def.getReverse(), RE = MI->getParent()->rend();
+         MI->isFullCopy() && RI != RE; ++RI)
+      if (RI->definesRegister(MI->getOperand(1).getReg(), TRI))
+        MI = &*RI;
+    unsigned Width;
+    unsigned ValidFlags = getResultFlags(*MI, Width);
+    // Only OR A,A, rather than CP 0, sets parity.
+    if (CmpInstr.getOpcode() != Z80::OR8ar)
+      ValidFlags &= ~FlagPV;
+    if (!ValidFlags || MI->getParent() != &MBB ||
+        Width != getCompareWidth(CmpInstr) || UsedFlags & ~ValidFlags)
+      MI = nullptr;
+  }
 
   // We iterate backwards, starting from the instruction before CmpInstr, and
-  // stopping when we reach the definition of a source register or the end of
-  // the BB. RI points to the instruction before CmpInstr. If the definition is
-  // in this BB, RE points to it, otherwise RE is the beginning of the BB.
-  MachineBasicBlock::reverse_iterator RE = CmpInstr.getParent()->rend();
-  if (CmpInstr.getParent() == MI->getParent())
-    RE = Def.getReverse(); // points to MI
+  // stopping when we reach the producer of the value compared or the end of
+  // the BB, looking for an earlier compare that makes CmpInstr redundant.
+  MachineInstr *SubInstr = nullptr;
+  MachineBasicBlock::reverse_iterator RE = MBB.rend();
+  if (MI)
+    RE = MachineBasicBlock::iterator(MI).getReverse();
   for (auto RI = ++I.getReverse(); RI != RE; ++RI) {
     MachineInstr &Instr = *RI;
-    // Check whether CmpInstr can be made redundant by the current instruction.
-    if (!IsCmpZero && isRedundantFlagInstr(CmpInstr, SrcReg, SrcReg2, CmpMask,
-                                           CmpValue, Instr)) {
+    unsigned RedundantFlags = MI ? 0 : getRedundantFlags(CmpInstr, SrcReg,
+                                                         SrcReg2, CmpMask,
+                                                         CmpValue, Instr);
+    if (RedundantFlags && !(UsedFlags & ~RedundantFlags)) {
       SubInstr = &Instr;
       break;
     }
@@ -1179,111 +1187,20 @@ bool Z80InstrInfo::optimizeCompareInstr(MachineInstr &CmpInstr,
       return false;
   }
 
-  // Return false if no candidates exist.
-  if (!IsCmpZero && !SubInstr)
-    return false;
-
-  // Scan forward from the instruction after CmpInstr for uses of F.
-  // It is safe to remove CmpInstr if F is redefined or killed.
-  // If we are at the end of the BB, we need to check whether F is live-out.
-  bool IsSafe = false;
-  MachineBasicBlock::iterator E = CmpInstr.getParent()->end();
-  for (++I; I != E; ++I) {
-    const MachineInstr &Instr = *I;
-    bool ModifiesFlags = Instr.modifiesRegister(Z80::F, TRI);
-    bool UsesFlags = Instr.readsRegister(Z80::F, TRI);
-    if (ModifiesFlags && !UsesFlags) {
-      IsSafe = true;
-      break;
-    }
-    if (!ModifiesFlags && !UsesFlags)
-      continue;
-    if (IsCmpZero) {
-      Z80::CondCode OldCC;
-      switch (Instr.getOpcode()) {
-      default:
-        OldCC = Z80::COND_INVALID;
-        break;
-      case Z80::JQCC:
-        OldCC = static_cast<Z80::CondCode>(Instr.getOperand(1).getImm());
-        break;
-      case Z80::ADC8ar: case Z80::ADC8ai: case Z80::ADC8ap: case Z80::ADC8ao:
-      case Z80::SBC8ar: case Z80::SBC8ai: case Z80::SBC8ap: case Z80::SBC8ao:
-      case Z80::SBC16ao:case Z80::ADC16ao:
-        OldCC = Z80::COND_C;
-        break;
-      }
-      switch (OldCC) {
-      default: break;
-      case Z80::COND_NC: case Z80::COND_C:
-      case Z80::COND_PO: case Z80::COND_PE:
-        // CF or PV are used, we can't perform this optimization.
-        return false;
-      }
-    }
-    if (ModifiesFlags || Instr.killsRegister(Z80::F, TRI)) {
-      // It is safe to remove CmpInstr if F is updated again or killed.
-      IsSafe = true;
-      break;
-    }
-  }
-  if (IsCmpZero && !IsSafe) {
-    MachineBasicBlock *MBB = CmpInstr.getParent();
-    for (MachineBasicBlock *Successor : MBB->successors())
-      if (Successor->isLiveIn(Z80::F))
-        return false;
-  }
-
   // The instruction to be updated is either Sub or MI.
-  if (IsCmpZero)
+  if (MI)
     SubInstr = MI;
+  if (!SubInstr)
+    return false;
 
   // Make sure Sub instruction defines F and mark the def live.
-  unsigned i = 0, e = SubInstr->getNumOperands();
-  for (; i != e; ++i) {
-    MachineOperand &MO = SubInstr->getOperand(i);
-    if (MO.isReg() && MO.isDef() && MO.getReg() == Z80::F) {
-      MO.setIsDead(false);
-      break;
-    }
-  }
-  assert(i != e && "Unable to locate a def EFLAGS operand");
+  MachineOperand *FlagDef = SubInstr->findRegisterDefOperand(Z80::F);
+  assert(FlagDef && "Unable to locate a def F operand");
+  FlagDef->setIsDead(false);
 
+  DEBUG(dbgs() << "Removing redundant compare: "; CmpInstr.dump());
   CmpInstr.eraseFromParent();
   return true;
-
-  // Check whether we can replace SUB with CMP.
-  switch (CmpInstr.getOpcode()) {
-  default: return false;
-  case Z80::SUB8ai:
-    // cp a,0 -> or a,a (a szhc have same behavior)
-    // FIXME: This doesn't work if the pv flag is used.
-    if (!CmpInstr.getOperand(0).getImm()) {
-      CmpInstr.setDesc(get(Z80::OR8ar));
-      CmpInstr.getOperand(0).ChangeToRegister(Z80::A, /*isDef=*/false);
-      return true;
-    }
-    LLVM_FALLTHROUGH;
-  case Z80::SUB8ar:
-  case Z80::SUB8ap:
-  case Z80::SUB8ao: {
-    if (!CmpInstr.registerDefIsDead(Z80::A))
-      return false;
-    // There is no use of the destination register, we can replace SUB with CMP.
-    unsigned NewOpcode = 0;
-    switch (CmpInstr.getOpcode()) {
-    default: llvm_unreachable("Unreachable!");
-    case Z80::SUB8ai: NewOpcode = Z80::CP8ai; break;
-    case Z80::SUB8ar: NewOpcode = Z80::CP8ar; break;
-    case Z80::SUB8ap: NewOpcode = Z80::CP8ap; break;
-    case Z80::SUB8ao: NewOpcode = Z80::CP8ao; break;
-    }
-    CmpInstr.setDesc(get(NewOpcode));
-    //CmpInstr.findRegisterDefOperand(Z80::A)->setIsDead(false);
-    //BuildMI(*CmpInstr.getParent(), ++MachineBasicBlock::iterator(CmpInstr), CmpInstr.getDebugLoc(), get(TargetOpcode::COPY), SrcReg).addReg(Z80::A, RegState::Kill);
-    return true;
-  }
-  }
 }
 
 MachineInstr *
@@ -1324,3 +1241,114 @@ Z80InstrInfo::foldMemoryOperandImpl(MachineFunction &MF, MachineInstr &MI,
   return nullptr;
   llvm_unreachable("Unimplemented");
 }
+
+/// Constants defining how certain sequences should be outlined.
+///
+/// MachineOutlinerDefault implies that the function is called with a call
+/// instruction, and a return must be emitted for the outlined function frame.
+///
+/// MachineOutlinerTailCall implies that the function is being tail called, by
+/// jumping to it, and the candidate already ends in a return or tail call.
+enum MachineOutlinerClass {
+  MachineOutlinerDefault,
+  MachineOutlinerTailCall
+};
+
+std::pair<size_t, unsigned>
+Z80InstrInfo::getOutliningCallOverhead(MachineBasicBlock::iterator &StartIt,
+                                       MachineBasicBlock::iterator &EndIt)
+    const {
+  // A call or a jump, both of which are a single instruction.
+  if (EndIt->isTerminator())
+    return std::make_pair(1, MachineOutlinerTailCall);
+  return std::make_pair(1, MachineOutlinerDefault);
+}
+
+std::pair<size_t, unsigned> Z80InstrInfo::getOutliningFrameOverhead(
+    std::vector<std::pair<MachineBasicBlock::iterator,
+                          MachineBasicBlock::iterator>> &CandidateClass)
+    const {
+  // A candidate ending in a terminator already returns, otherwise we need RET.
+  if (CandidateClass[0].second->isTerminator())
+    return std::make_pair(0, MachineOutlinerTailCall);
+  return std::make_pair(1, MachineOutlinerDefault);
+}
+
+bool Z80InstrInfo::isFunctionSafeToOutlineFrom(MachineFunction &MF) const {
+  // Functions placed in an explicit section may live in a separate bank or
+  // overlay, so they can't call into the shared outlined code.
+  return !MF.getFunction()->hasSection();
+}
+
+Z80InstrInfo::MachineOutlinerInstrType
+Z80InstrInfo::getOutliningType(MachineInstr &MI) const {
+  // Don't allow debug values to impact outlining type.
+  if (MI.isDebugValue() || MI.isIndirectDebugValue())
+    return MachineOutlinerInstrType::Invisible;
+
+  // Positions can't safely be outlined.
+  if (MI.isPosition())
+    return MachineOutlinerInstrType::Illegal;
+
+  // A return or tail call can be outlined as a jump, as long as the block
+  // doesn't fall through or branch anywhere else.
+  if (MI.isTerminator() || MI.isReturn()) {
+    if (!MI.getParent()->succ_empty())
+      return MachineOutlinerInstrType::Illegal;
+    switch (MI.getOpcode()) {
+    case Z80::JP16: case Z80::JP24: case Z80::JP16r: case Z80::JP24r:
+      return MachineOutlinerInstrType::Legal;
+    }
+    return MI.isReturn() ? MachineOutlinerInstrType::Legal
+                         : MachineOutlinerInstrType::Illegal;
+  }
+
+  // The outlined call pushes a return address, so anything that reads or
+  // writes the stack pointer would see a different stack.  Call, jump and
+  // return instructions preserve F, so flags can be freely live across the
+  // outlined sequence and need no special treatment.
+  for (unsigned StackReg : {Z80::SPS, Z80::SPL})
+    if (MI.modifiesRegister(StackReg, &RI) || MI.readsRegister(StackReg, &RI) ||
+        MI.getDesc().hasImplicitUseOfPhysReg(StackReg) ||
+        MI.getDesc().hasImplicitDefOfPhysReg(StackReg))
+      return MachineOutlinerInstrType::Illegal;
+
+  // Make sure none of the operands of this instruction do anything tricky.
+  for (const MachineOperand &MOP : MI.operands())
+    if (MOP.isCPI() || MOP.isJTI() || MOP.isCFIIndex() || MOP.isFI() ||
+        MOP.isTargetIndex() || MOP.isMBB())
+      return MachineOutlinerInstrType::Illegal;
+
+  return MachineOutlinerInstrType::Legal;
+}
+
+void Z80InstrInfo::insertOutlinerEpilogue(MachineBasicBlock &MBB,
+                                          MachineFunction &MF,
+                                          unsigned FrameClass) const {
+  // If we're a tail call, we already have a return, so don't do anything.
+  if (FrameClass == MachineOutlinerTailCall)
+    return;
+
+  // We're a normal call, so our sequence doesn't have a return instruction.
+  MBB.insert(MBB.end(), BuildMI(MF, DebugLoc(), get(Z80::RET)));
+}
+
+void Z80InstrInfo::insertOutlinerPrologue(MachineBasicBlock &MBB,
+                                          MachineFunction &MF,
+                                          unsigned FrameClass) const {}
+
+MachineBasicBlock::iterator
+Z80InstrInfo::insertOutlinedCall(Module &M, MachineBasicBlock &MBB,
+                                 MachineBasicBlock::iterator &It,
+                                 MachineFunction &MF,
+                                 unsigned CallClass) const {
+  bool Is24Bit = Subtarget.is24Bit();
+  unsigned Opc;
+  if (CallClass == MachineOutlinerTailCall)
+    Opc = Is24Bit ? Z80::JP24 : Z80::JP16;
+  else
+    Opc = Is24Bit ? Z80::CALL24i : Z80::CALL16i;
+  It = MBB.insert(It, BuildMI(MF, DebugLoc(), get(Opc))
+                  .addGlobalAddress(M.getNamedValue(MF.getName())));
+  return It;
+}
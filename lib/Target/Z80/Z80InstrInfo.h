@@ -52,6 +52,15 @@ bool splitReg(unsigned ByteSize, unsigned Opc8, unsigned Opc16, unsigned Opc24,
 } // end namespace Z80;
 
 namespace Z80II {
+  // Target Operand Flag enum.
+  enum TOF {
+    MO_NO_FLAG,
+
+    /// MO_SDATA - On a symbol operand, this represents the displacement of
+    /// the symbol from the small data base held in IY.
+    MO_SDATA
+  };
+
   enum {
     PrefixShift = 0,
     NoPrefix = 0 << PrefixShift,
@@ -171,6 +180,25 @@ public:
                         MachineInstr &LoadMI,
                         LiveIntervals *LIS = nullptr) const override;
 
+  // Machine outliner hooks.
+  std::pair<size_t, unsigned>
+  getOutliningCallOverhead(MachineBasicBlock::iterator &StartIt,
+                           MachineBasicBlock::iterator &EndIt) const override;
+  std::pair<size_t, unsigned> getOutliningFrameOverhead(
+      std::vector<std::pair<MachineBasicBlock::iterator,
+                            MachineBasicBlock::iterator>> &CandidateClass)
+      const override;
+  bool isFunctionSafeToOutlineFrom(MachineFunction &MF) const override;
+  MachineOutlinerInstrType getOutliningType(MachineInstr &MI) const override;
+  void insertOutlinerEpilogue(MachineBasicBlock &MBB, MachineFunction &MF,
+                              unsigned FrameClass) const override;
+  void insertOutlinerPrologue(MachineBasicBlock &MBB, MachineFunction &MF,
+                              unsigned FrameClass) const override;
+  MachineBasicBlock::iterator
+  insertOutlinedCall(Module &M, MachineBasicBlock &MBB,
+                     MachineBasicBlock::iterator &It, MachineFunction &MF,
+                     unsigned CallClass) const override;
+
 private:
   /// canExchange - This returns whether the two instructions can be directly
   /// exchanged with one EX instruction. Since the only register exchange
@@ -183,6 +211,13 @@ private:
   bool isFrameOperand(const MachineInstr &MI, unsigned int Op,
                       int &FrameIndex) const;
 
+  /// getRedundantFlags - Return the flags that OI, an earlier compare or
+  /// subtract, already set the same way that CmpInstr, which compares the
+  /// given sources, would.
+  unsigned getRedundantFlags(MachineInstr &CmpInstr, unsigned SrcReg,
+                             unsigned SrcReg2, int CmpMask, int CmpValue,
+                             MachineInstr &OI) const;
+
   void expandLoadStoreWord(const TargetRegisterClass *ARC, unsigned AOpc,
                            const TargetRegisterClass *ORC, unsigned OOpc,
                            MachineInstr &MI, unsigned RegIdx) const;
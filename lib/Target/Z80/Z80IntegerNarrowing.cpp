@@ -0,0 +1,280 @@
+//===-- Z80IntegerNarrowing.cpp - Narrow promoted integer arithmetic ------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines a pass that undoes C integer promotion where it is not
+// observable.  Arithmetic and phis whose users only demand the low byte are
+// rebuilt as i8 operations, and compares whose operands are known to be
+// extended bytes are done on the bytes.  Unlike the DAG combiner, this sees
+// the whole function, so loop-carried values narrow as well.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Z80.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/DemandedBits.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Pass.h"
+#include <algorithm>
+using namespace llvm;
+using namespace llvm::PatternMatch;
+
+#define DEBUG_TYPE "z80-narrow"
+
+STATISTIC(NumNarrowed, "Number of instructions narrowed to i8");
+STATISTIC(NumNarrowedCmps, "Number of compares narrowed to i8");
+
+namespace {
+class Z80IntegerNarrowing : public FunctionPass {
+public:
+  Z80IntegerNarrowing() : FunctionPass(ID) {
+    initializeZ80IntegerNarrowingPass(*PassRegistry::getPassRegistry());
+  }
+
+  bool runOnFunction(Function &F) override;
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<DemandedBitsWrapperPass>();
+    AU.setPreservesCFG();
+  }
+
+  StringRef getPassName() const override {
+    return "Z80 Integer Narrowing";
+  }
+
+  static char ID;
+
+private:
+  bool isNarrowable(const Instruction &I) const;
+  Value *getNarrowValue(Value *V, Instruction *InsertPt);
+  bool narrowArithmetic(Function &F, DemandedBits &DB);
+  bool narrowCompares(Function &F);
+
+  Type *ByteTy;
+  DenseMap<Value *, Value *> Narrowed;
+};
+} // end anonymous namespace
+
+char Z80IntegerNarrowing::ID = 0;
+INITIALIZE_PASS_BEGIN(Z80IntegerNarrowing, DEBUG_TYPE,
+                      "Z80 Integer Narrowing", false, false)
+INITIALIZE_PASS_DEPENDENCY(DemandedBitsWrapperPass)
+INITIALIZE_PASS_END(Z80IntegerNarrowing, DEBUG_TYPE,
+                    "Z80 Integer Narrowing", false, false)
+
+FunctionPass *llvm::createZ80IntegerNarrowingPass() {
+  return new Z80IntegerNarrowing();
+}
+
+/// Return true if the low byte of I only depends on the low bytes of its
+/// operands, so that it can be recomputed on bytes.
+bool Z80IntegerNarrowing::isNarrowable(const Instruction &I) const {
+  auto *Ty = dyn_cast<IntegerType>(I.getType());
+  if (!Ty || Ty->getBitWidth() <= 8)
+    return false;
+  switch (I.getOpcode()) {
+  default:
+    return false;
+  case Instruction::PHI:
+    return !I.getParent()->isEHPad();
+  case Instruction::Add:
+  case Instruction::Sub:
+  case Instruction::Mul:
+  case Instruction::And:
+  case Instruction::Or:
+  case Instruction::Xor:
+    return true;
+  case Instruction::Shl:
+    if (auto *Amt = dyn_cast<ConstantInt>(I.getOperand(1)))
+      return Amt->getValue().ult(8);
+    return false;
+  }
+}
+
+/// Return an i8 value equal to the low byte of V, inserting a truncate before
+/// InsertPt if there is nothing better to use.
+Value *Z80IntegerNarrowing::getNarrowValue(Value *V, Instruction *InsertPt) {
+  if (Value *NarrowV = Narrowed.lookup(V))
+    return NarrowV;
+  if (auto *C = dyn_cast<Constant>(V))
+    return ConstantExpr::getTrunc(C, ByteTy);
+  Value *Src;
+  if (match(V, m_ZExtOrSExt(m_Value(Src)))) {
+    if (Src->getType() == ByteTy)
+      return Src;
+    if (Src->getType()->getIntegerBitWidth() < 8)
+      return CastInst::Create(cast<CastInst>(V)->getOpcode(), Src, ByteTy,
+                              V->getName() + ".lo", InsertPt);
+  }
+  return new TruncInst(V, ByteTy, V->getName() + ".lo", InsertPt);
+}
+
+/// Return true if U, a user that stays wide, only looks at the low byte of
+/// its operand.
+static bool usesLowByteOnly(const User *U) {
+  if (auto *Trunc = dyn_cast<TruncInst>(U))
+    return Trunc->getType()->getIntegerBitWidth() <= 8;
+  const APInt *Mask;
+  return match(U, m_And(m_Value(), m_APInt(Mask))) &&
+         Mask->getActiveBits() <= 8;
+}
+
+/// Drop the flags of I that may no longer hold once the high bits of an
+/// operand change, as BDCE does.
+static void dropPoisonFlags(Instruction *I) {
+  if (isa<OverflowingBinaryOperator>(I)) {
+    I->setHasNoSignedWrap(false);
+    I->setHasNoUnsignedWrap(false);
+  }
+  if (isa<PossiblyExactOperator>(I))
+    I->setIsExact(false);
+}
+
+bool Z80IntegerNarrowing::narrowArithmetic(Function &F, DemandedBits &DB) {
+  // Find wide values whose users only look at the low byte.  Visiting in
+  // reverse post order means operands other than phis are seen first.
+  SmallVector<Instruction *, 16> Candidates;
+  SmallPtrSet<Instruction *, 16> CandidateSet;
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (BasicBlock *BB : RPOT)
+    for (Instruction &I : *BB)
+      if (isNarrowable(I) && !DB.isInstructionDead(&I)) {
+        Candidates.push_back(&I);
+        CandidateSet.insert(&I);
+      }
+
+  // DemandedBits counts every phi operand as fully demanded, so a value that
+  // goes around a loop never looks narrow to it.  Instead, assume that all
+  // candidates are narrow and drop those with a user needing more than the
+  // low byte until nothing changes, like computeMinimumValueSizes in the loop
+  // vectorizer.
+  bool Dropped;
+  do {
+    Dropped = false;
+    for (Instruction *I : Candidates) {
+      if (!CandidateSet.count(I) || DB.getDemandedBits(I).getActiveBits() <= 8)
+        continue;
+      for (User *U : I->users())
+        if (!CandidateSet.count(cast<Instruction>(U)) && !usesLowByteOnly(U)) {
+          CandidateSet.erase(I);
+          Dropped = true;
+          break;
+        }
+    }
+  } while (Dropped);
+  Candidates.erase(std::remove_if(Candidates.begin(), Candidates.end(),
+                                  [&](Instruction *I) {
+                                    return !CandidateSet.count(I);
+                                  }),
+                   Candidates.end());
+  if (Candidates.empty())
+    return false;
+
+  // Phis can be used before their incoming values are narrowed, so create
+  // them all up front and fill them in at the end.
+  for (Instruction *I : Candidates)
+    if (auto *P = dyn_cast<PHINode>(I))
+      Narrowed[P] = PHINode::Create(ByteTy, P->getNumIncomingValues(),
+                                    P->getName() + ".lo", P);
+  for (Instruction *I : Candidates) {
+    if (isa<PHINode>(I))
+      continue;
+    auto *BO = cast<BinaryOperator>(I);
+    Value *LHS = getNarrowValue(BO->getOperand(0), BO);
+    Value *RHS = getNarrowValue(BO->getOperand(1), BO);
+    // Wrap flags don't carry over to the low byte.
+    Narrowed[BO] = BinaryOperator::Create(BO->getOpcode(), LHS, RHS,
+                                          BO->getName() + ".lo", BO);
+  }
+  for (Instruction *I : Candidates)
+    if (auto *P = dyn_cast<PHINode>(I)) {
+      auto *NarrowP = cast<PHINode>(Narrowed[P]);
+      for (unsigned Op = 0, E = P->getNumIncomingValues(); Op != E; ++Op) {
+        BasicBlock *Pred = P->getIncomingBlock(Op);
+        NarrowP->addIncoming(
+            getNarrowValue(P->getIncomingValue(Op), Pred->getTerminator()),
+            Pred);
+      }
+    }
+
+  // The high bytes aren't demanded, so any extension will do for the users
+  // that are still wide, but their wrap and exact flags may no longer hold.
+  for (Instruction *I : Candidates) {
+    for (User *U : I->users())
+      if (!CandidateSet.count(cast<Instruction>(U)))
+        dropPoisonFlags(cast<Instruction>(U));
+    Instruction *InsertPt = I;
+    if (isa<PHINode>(I))
+      InsertPt = &*I->getParent()->getFirstInsertionPt();
+    I->replaceAllUsesWith(new ZExtInst(Narrowed[I], I->getType(),
+                                       I->getName() + ".ext", InsertPt));
+    DEBUG(dbgs() << "Narrowed: " << *I << '\n');
+  }
+  for (Instruction *I : Candidates)
+    I->eraseFromParent();
+  NumNarrowed += Candidates.size();
+  Narrowed.clear();
+  return true;
+}
+
+bool Z80IntegerNarrowing::narrowCompares(Function &F) {
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  bool Changed = false;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB) {
+      auto *Cmp = dyn_cast<ICmpInst>(&I);
+      if (!Cmp)
+        continue;
+      auto *Ty = dyn_cast<IntegerType>(Cmp->getOperand(0)->getType());
+      if (!Ty || Ty->getBitWidth() <= 8)
+        continue;
+      unsigned Width = Ty->getBitWidth();
+      APInt HighBits = APInt::getHighBitsSet(Width, Width - 8);
+      bool ZeroExtended = true, SignExtended = true;
+      for (Value *Op : Cmp->operands()) {
+        ZeroExtended &= MaskedValueIsZero(Op, HighBits, DL, 0, nullptr, Cmp);
+        SignExtended &= ComputeNumSignBits(Op, DL, 0, nullptr, Cmp) >
+                        Width - 8;
+      }
+      // Extended bytes compare like the bytes themselves, except that a zero
+      // extended byte is never negative.
+      ICmpInst::Predicate Pred;
+      if (SignExtended)
+        Pred = Cmp->getPredicate();
+      else if (ZeroExtended)
+        Pred = Cmp->getUnsignedPredicate();
+      else
+        continue;
+      DEBUG(dbgs() << "Narrowing compare: " << *Cmp << '\n');
+      Cmp->setOperand(0, getNarrowValue(Cmp->getOperand(0), Cmp));
+      Cmp->setOperand(1, getNarrowValue(Cmp->getOperand(1), Cmp));
+      Cmp->setPredicate(Pred);
+      ++NumNarrowedCmps;
+      Changed = true;
+    }
+  return Changed;
+}
+
+bool Z80IntegerNarrowing::runOnFunction(Function &F) {
+  if (skipFunction(F))
+    return false;
+  ByteTy = Type::getInt8Ty(F.getContext());
+  DemandedBits &DB = getAnalysis<DemandedBitsWrapperPass>().getDemandedBits();
+  bool Changed = narrowArithmetic(F, DB);
+  Changed |= narrowCompares(F);
+  return Changed;
+}
@@ -13,6 +13,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "Z80AsmPrinter.h"
+#include "Z80TargetObjectFile.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/MC/MCContext.h"
 #include "llvm/MC/MCInst.h"
@@ -48,7 +49,6 @@ Z80MCInstLower::Z80MCInstLower(const MachineFunction &MF, Z80AsmPrinter &AP)
 /// GetGlobalAddressSymbol - Lower an MO_GlobalAddress operand to an MCSymbol.
 MCSymbol *
 Z80MCInstLower::GetGlobalAddressSymbol(const MachineOperand &MO) const {
-  assert(!MO.getTargetFlags() && "Unknown target flag on GV operand");
   return AsmPrinter.getSymbol(MO.getGlobal());
 }
 
@@ -61,10 +61,19 @@ Z80MCInstLower::GetExternalSymbolSymbol(const MachineOperand &MO) const {
 
 MCOperand Z80MCInstLower::LowerSymbolOperand(const MachineOperand &MO,
                                              MCSymbol *Sym) const {
-  assert(!MO.getTargetFlags() && "Unknown target flag on GV operand");
   const MCExpr *Expr = MCSymbolRefExpr::create(Sym, Ctx);
   if (auto Off = MO.getOffset())
     Expr = MCBinaryExpr::createAdd(Expr, MCConstantExpr::create(Off, Ctx), Ctx);
+  switch (MO.getTargetFlags()) {
+  default: llvm_unreachable("Unknown target flag on GV operand");
+  case Z80II::MO_NO_FLAG:
+    break;
+  case Z80II::MO_SDATA:
+    Expr = MCBinaryExpr::createSub(
+        Expr, MCSymbolRefExpr::create(AsmPrinter.GetExternalSymbolSymbol(
+            Z80TargetObjectFile::getSmallDataBaseName()), Ctx), Ctx);
+    break;
+  }
   return MCOperand::createExpr(Expr);
 }
 
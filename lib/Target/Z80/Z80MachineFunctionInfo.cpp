@@ -8,7 +8,42 @@
 //===----------------------------------------------------------------------===//
 
 #include "Z80MachineFunctionInfo.h"
+#include "llvm/CodeGen/FunctionLoweringInfo.h"
+#include "llvm/CodeGen/MachineFrameInfo.h"
+#include "llvm/IR/Function.h"
 
 using namespace llvm;
 
 void Z80MachineFunctionInfo::anchor() { }
+
+Z80MachineFunctionInfo::Z80MachineFunctionInfo(MachineFunction &MF)
+    : OptForSize(MF.getFunction()->getAttributes().hasAttribute(
+          AttributeList::FunctionIndex, Attribute::OptimizeForSize)) {}
+
+bool Z80MachineFunctionInfo::shouldOptForSize(
+    const MachineBasicBlock *MBB) const {
+  if (!MBB && LoweringInfo)
+    MBB = LoweringInfo->MBB;
+  if (MBB)
+    if (const BasicBlock *BB = MBB->getBasicBlock()) {
+      auto I = BlockOptForSize.find(BB);
+      if (I != BlockOptForSize.end())
+        return I->second;
+    }
+  return OptForSize;
+}
+
+int Z80MachineFunctionInfo::getI64Slot(MachineFunction &MF) {
+  // The helper calls of different blocks never overlap, so the slots only
+  // have to be distinct within a block.
+  const MachineBasicBlock *MBB = LoweringInfo ? LoweringInfo->MBB : nullptr;
+  if (!MBB)
+    return MF.getFrameInfo().CreateStackObject(8, 1, false);
+  if (MBB != I64SlotsBlock) {
+    I64SlotsBlock = MBB;
+    I64SlotsUsed = 0;
+  }
+  if (I64SlotsUsed == I64Slots.size())
+    I64Slots.push_back(MF.getFrameInfo().CreateStackObject(8, 1, false));
+  return I64Slots[I64SlotsUsed++];
+}
@@ -14,10 +14,14 @@
 #ifndef LLVM_LIB_TARGET_Z80_Z80MACHINEFUNCTIONINFO_H
 #define LLVM_LIB_TARGET_Z80_Z80MACHINEFUNCTIONINFO_H
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/CodeGen/MachineFunction.h"
 
 namespace llvm {
 
+class FunctionLoweringInfo;
+
 /// Z80MachineFunctionInfo - This class is derived from MachineFunction and
 /// contains private X86 target-specific information for each MachineFunction.
 class Z80MachineFunctionInfo : public MachineFunctionInfo {
@@ -30,16 +34,61 @@ class Z80MachineFunctionInfo : public MachineFunctionInfo {
   /// VarArgsFrameIndex - FrameIndex for start of varargs area.
   int VarArgsFrameIndex = 0;
 
+  /// ArgumentStackSize - Number of bytes of fixed arguments passed on the
+  /// stack, which the caller pops and a tail call may reuse.
+  unsigned ArgumentStackSize = 0;
+
+  /// ArgumentsMutable - Whether tail calls may store their stack arguments
+  /// over the incoming ones, which are immutable otherwise.
+  bool ArgumentsMutable = false;
+
+  /// OptForSize - Whether the function as a whole is optimized for size.
+  bool OptForSize = false;
+
+  /// BlockOptForSize - Blocks where the profile overrides OptForSize, cold
+  /// blocks preferring size and hot blocks preferring speed.
+  DenseMap<const BasicBlock *, bool> BlockOptForSize;
+
+  /// I64Slots - Stack temporaries for the operands of i64 helpers, shared by
+  /// all blocks.  I64SlotsUsed counts those taken by I64SlotsBlock.
+  SmallVector<int, 4> I64Slots;
+  const MachineBasicBlock *I64SlotsBlock = nullptr;
+  unsigned I64SlotsUsed = 0;
+
+  /// LoweringInfo - The state of instruction selection, used to find the
+  /// block being lowered.  Only set while selecting instructions.
+  const FunctionLoweringInfo *LoweringInfo = nullptr;
+
 public:
   Z80MachineFunctionInfo() = default;
 
-  explicit Z80MachineFunctionInfo(MachineFunction &MF) {}
+  explicit Z80MachineFunctionInfo(MachineFunction &MF);
 
   unsigned getCalleeSavedFrameSize() const { return CalleeSavedFrameSize; }
   void setCalleeSavedFrameSize(unsigned Bytes) { CalleeSavedFrameSize = Bytes; }
 
   int getVarArgsFrameIndex() const { return VarArgsFrameIndex; }
   void setVarArgsFrameIndex(int Idx) { VarArgsFrameIndex = Idx; }
+
+  unsigned getArgumentStackSize() const { return ArgumentStackSize; }
+  void setArgumentStackSize(unsigned Size) { ArgumentStackSize = Size; }
+
+  bool getArgumentsMutable() const { return ArgumentsMutable; }
+  void setArgumentsMutable(bool Mutable) { ArgumentsMutable = Mutable; }
+
+  void setBlockOptForSize(const BasicBlock *BB, bool OptSize) {
+    BlockOptForSize[BB] = OptSize;
+  }
+
+  void setLoweringInfo(const FunctionLoweringInfo *FLI) { LoweringInfo = FLI; }
+
+  /// Return an 8-byte stack temporary for an i64 helper operand that no other
+  /// operand in the block being selected uses.
+  int getI64Slot(MachineFunction &MF);
+
+  /// Return true if code in MBB should be optimized for size rather than
+  /// speed.  A null MBB refers to the block being selected.
+  bool shouldOptForSize(const MachineBasicBlock *MBB = nullptr) const;
 };
 
 } // End llvm namespace
@@ -0,0 +1,183 @@
+//===-- Z80PushPopSpills.cpp - Turn nested spills into push/pop pairs -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines a pass that replaces a spill slot store and reload with a
+// push and pop when both live in the same block and the stack is balanced
+// between them.  A push/pop pair is smaller and faster than two frame-relative
+// accesses, and once every spill slot is gone the function no longer needs a
+// frame at all.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Z80.h"
+#include "Z80InstrInfo.h"
+#include "Z80Subtarget.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/CodeGen/MachineFrameInfo.h"
+#include "llvm/CodeGen/MachineFunctionPass.h"
+#include "llvm/CodeGen/MachineInstrBuilder.h"
+using namespace llvm;
+
+#define DEBUG_TYPE "z80-push-pop-spills"
+
+STATISTIC(NumPushPopSpills, "Number of spill slots replaced by push/pop");
+
+namespace {
+class Z80PushPopSpills : public MachineFunctionPass {
+public:
+  Z80PushPopSpills() : MachineFunctionPass(ID) {}
+
+  bool runOnMachineFunction(MachineFunction &MF) override;
+
+  MachineFunctionProperties getRequiredProperties() const override {
+    return MachineFunctionProperties()
+      .set(MachineFunctionProperties::Property::NoVRegs);
+  }
+
+  StringRef getPassName() const override {
+    return "Z80 Push/Pop Spills";
+  }
+
+private:
+  struct SpillPair {
+    MachineInstr *Store = nullptr;
+    MachineInstr *Load = nullptr;
+    bool Valid = true;
+  };
+
+  bool isStackBalanced(MachineBasicBlock::iterator I,
+                       MachineBasicBlock::iterator E) const;
+  unsigned getPushPopReg(unsigned Reg) const;
+
+  const Z80Subtarget *STI;
+  const Z80InstrInfo *TII;
+  const TargetRegisterInfo *TRI;
+
+  static char ID;
+};
+
+char Z80PushPopSpills::ID = 0;
+} // end anonymous namespace
+
+FunctionPass *llvm::createZ80PushPopSpills() {
+  return new Z80PushPopSpills();
+}
+
+/// Return the register to push or pop in place of spilling Reg, or 0 if Reg
+/// can not be pushed.
+unsigned Z80PushPopSpills::getPushPopReg(unsigned Reg) const {
+  if (!STI->is24Bit())
+    return Z80::R16RegClass.contains(Reg) ? Reg : 0;
+  if (Z80::R24RegClass.contains(Reg))
+    return Reg;
+  if (Z80::R16RegClass.contains(Reg))
+    return TRI->getMatchingSuperReg(Reg, Z80::sub_short, &Z80::R24RegClass);
+  return 0;
+}
+
+/// Return true if every push between I and E is popped again, nothing else
+/// touches the stack pointer, and any call sequence is fully contained.
+bool Z80PushPopSpills::isStackBalanced(MachineBasicBlock::iterator I,
+                                       MachineBasicBlock::iterator E) const {
+  unsigned SetupOpc = TII->getCallFrameSetupOpcode();
+  unsigned DestroyOpc = TII->getCallFrameDestroyOpcode();
+  unsigned SPReg = STI->is24Bit() ? Z80::SPL : Z80::SPS;
+  int Depth = 0, CallDepth = 0;
+  for (; I != E; ++I) {
+    unsigned Opc = I->getOpcode();
+    if (Opc == SetupOpc) {
+      ++CallDepth;
+    } else if (Opc == DestroyOpc) {
+      if (--CallDepth < 0)
+        return false;
+    } else if (CallDepth) {
+      // Argument pushes are released by the matching call frame destroy.
+      continue;
+    } else if (Opc == Z80::PUSH16r || Opc == Z80::PUSH24r) {
+      ++Depth;
+    } else if (Opc == Z80::POP16r || Opc == Z80::POP24r) {
+      if (--Depth < 0)
+        return false;
+    } else if (I->readsRegister(SPReg, TRI) ||
+               I->modifiesRegister(SPReg, TRI)) {
+      return false;
+    }
+  }
+  return !Depth && !CallDepth;
+}
+
+bool Z80PushPopSpills::runOnMachineFunction(MachineFunction &MF) {
+  if (skipFunction(*MF.getFunction()))
+    return false;
+  STI = &MF.getSubtarget<Z80Subtarget>();
+  TII = STI->getInstrInfo();
+  TRI = STI->getRegisterInfo();
+  MachineFrameInfo &MFI = MF.getFrameInfo();
+
+  // Find spill slots with exactly one store followed by one reload in the
+  // same block.
+  MapVector<int, SpillPair> Slots;
+  for (auto &MBB : MF)
+    for (auto &MI : MBB)
+      for (const MachineOperand &MO : MI.operands()) {
+        if (!MO.isFI() || !MFI.isSpillSlotObjectIndex(MO.getIndex()))
+          continue;
+        SpillPair &Pair = Slots[MO.getIndex()];
+        int FI;
+        unsigned Reg;
+        if ((Reg = TII->isStoreToStackSlot(MI, FI)) && FI == MO.getIndex() &&
+            !Pair.Store && getPushPopReg(Reg))
+          Pair.Store = &MI;
+        else if ((Reg = TII->isLoadFromStackSlot(MI, FI)) &&
+                 FI == MO.getIndex() && Pair.Store && !Pair.Load &&
+                 Pair.Store->getParent() == &MBB && getPushPopReg(Reg))
+          Pair.Load = &MI;
+        else
+          Pair.Valid = false;
+      }
+
+  bool Changed = false;
+  for (auto &Slot : Slots) {
+    SpillPair &Pair = Slot.second;
+    if (!Pair.Valid || !Pair.Store || !Pair.Load)
+      continue;
+    MachineBasicBlock &MBB = *Pair.Store->getParent();
+    if (!isStackBalanced(std::next(Pair.Store->getIterator()),
+                         Pair.Load->getIterator()))
+      continue;
+    DEBUG(dbgs() << "Replacing spill slot fi#" << Slot.first
+                 << " with push/pop\n");
+
+    unsigned PushOpc = STI->is24Bit() ? Z80::PUSH24r : Z80::PUSH16r;
+    unsigned PopOpc = STI->is24Bit() ? Z80::POP24r : Z80::POP16r;
+    MachineOperand &Src = Pair.Store->getOperand(2);
+    unsigned SrcReg = getPushPopReg(Src.getReg());
+    MachineInstrBuilder Push =
+      BuildMI(MBB, *Pair.Store, Pair.Store->getDebugLoc(), TII->get(PushOpc));
+    if (SrcReg == Src.getReg())
+      Push.addReg(SrcReg, getKillRegState(Src.isKill()));
+    else
+      // Only the low part of the super register is live, the rest is don't
+      // care since the reload discards it again.
+      Push.addReg(SrcReg, RegState::Undef)
+        .addReg(Src.getReg(),
+                RegState::Implicit | getKillRegState(Src.isKill()));
+    unsigned DstReg = getPushPopReg(Pair.Load->getOperand(0).getReg());
+    BuildMI(MBB, *Pair.Load, Pair.Load->getDebugLoc(), TII->get(PopOpc),
+            DstReg);
+
+    Pair.Store->eraseFromParent();
+    Pair.Load->eraseFromParent();
+    MFI.RemoveStackObject(Slot.first);
+    ++NumPushPopSpills;
+    Changed = true;
+  }
+  return Changed;
+}
@@ -15,6 +15,7 @@
 #include "Z80FrameLowering.h"
 #include "Z80MachineFunctionInfo.h"
 #include "Z80Subtarget.h"
+#include "Z80TargetObjectFile.h"
 #include "MCTargetDesc/Z80MCTargetDesc.h"
 #include "llvm/CodeGen/MachineFrameInfo.h"
 #include "llvm/CodeGen/MachineFunction.h"
@@ -63,16 +64,17 @@ Z80RegisterInfo::getLargestLegalSuperClass(const TargetRegisterClass *RC,
 
 unsigned Z80RegisterInfo::getRegPressureLimit(const TargetRegisterClass *RC,
                                               MachineFunction &MF) const {
-  return 3;
-  const Z80FrameLowering *TFI = getFrameLowering(MF);
-
-  switch (RC->getID()) {
-  default:
-    return 0;
-  case Z80::R16RegClassID:
-  case Z80::R24RegClassID:
-    return 2;
-  }
+  const Z80Subtarget &STI = MF.getSubtarget<Z80Subtarget>();
+  BitVector Reserved = getReservedRegs(MF);
+  unsigned Limit = 0;
+  for (MCPhysReg Reg : *RC)
+    if (!Reserved.test(Reg) &&
+        (STI.hasIndexHalfRegs() || !Z80::I8RegClass.contains(Reg)))
+      ++Limit;
+  // Most 8-bit ALU operations go through A, so keep it out of the budget.
+  if (Limit > 1 && RC->contains(Z80::A))
+    --Limit;
+  return Limit;
 }
 
 const MCPhysReg *
@@ -130,6 +132,12 @@ BitVector Z80RegisterInfo::getReservedRegs(const MachineFunction &MF) const {
        ++I)
     Reserved.set(*I);
 
+  // Set the small data base register and its aliases as reserved if enabled.
+  if (Z80TargetObjectFile::hasSmallData())
+    for (MCSubRegIterator I(Z80::UIY, this, /*IncludesSelf=*/true);
+         I.isValid(); ++I)
+      Reserved.set(*I);
+
   return Reserved;
 }
 
@@ -209,7 +217,9 @@ void Z80RegisterInfo::eliminateFrameIndex(MachineBasicBlock::iterator II,
     BuildMI(MBB, II, DL, TII.get(Is24Bit ? Z80::ADD24ao : Z80::ADD16ao),
             ScratchReg).addReg(ScratchReg).addReg(OffsetReg, RegState::Kill);
     MI.getOperand(FIOperandNum).ChangeToRegister(ScratchReg, false);
-    if ((Is24Bit ? Z80::I24RegClass : Z80::I16RegClass).contains(ScratchReg))
+    // Inline asm memory operands print as (rr) when the displacement is zero.
+    if ((Is24Bit ? Z80::I24RegClass : Z80::I16RegClass).contains(ScratchReg) ||
+        MI.isInlineAsm())
       MI.getOperand(FIOperandNum + 1).ChangeToImmediate(0);
     else {
       switch (Opc) {
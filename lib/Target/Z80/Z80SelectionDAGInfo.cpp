@@ -0,0 +1,125 @@
+//===-- Z80SelectionDAGInfo.cpp - Z80 SelectionDAG Info -------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the Z80SelectionDAGInfo class.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Z80SelectionDAGInfo.h"
+#include "Z80ISelLowering.h"
+#include "Z80Subtarget.h"
+#include "llvm/CodeGen/SelectionDAG.h"
+#include "llvm/IR/LLVMContext.h"
+using namespace llvm;
+
+#define DEBUG_TYPE "z80-selectiondag-info"
+
+/// Copies longer than this are done with a loop rather than unrolled.
+static const uint64_t MaxUnrolledPortCopy = 8;
+
+/// Copies to or from the I/O address space can't go through memcpy, which
+/// would treat the ports as memory addresses.  They are done with the port
+/// incrementing block instructions when the ports are known to have a zero
+/// upper byte, unrolled into IN and OUT when short, and looped otherwise.
+SDValue Z80SelectionDAGInfo::EmitTargetCodeForMemcpy(
+    SelectionDAG &DAG, const SDLoc &dl, SDValue Chain, SDValue Dst, SDValue Src,
+    SDValue Size, unsigned Align, bool isVolatile, bool AlwaysInline,
+    MachinePointerInfo DstPtrInfo, MachinePointerInfo SrcPtrInfo) const {
+  bool ToPort = DstPtrInfo.getAddrSpace() == Z80AS::IO;
+  bool FromPort = SrcPtrInfo.getAddrSpace() == Z80AS::IO;
+  if (!ToPort && !FromPort)
+    return SDValue();
+  if (ToPort && FromPort) {
+    DAG.getContext()->emitError("cannot copy between two I/O ports");
+    return Chain;
+  }
+
+  const Z80Subtarget &STI =
+      DAG.getMachineFunction().getSubtarget<Z80Subtarget>();
+  bool Is24Bit = STI.is24Bit();
+  SDValue Mem = ToPort ? Src : Dst;
+  SDValue Port = DAG.getZExtOrTrunc(ToPort ? Dst : Src, dl, MVT::i16);
+
+  auto *ConstSize = dyn_cast<ConstantSDNode>(Size);
+  if (!ConstSize) {
+    unsigned Opc = ToPort ? Is24Bit ? Z80::OutLoop24r : Z80::OutLoop16r
+                          : Is24Bit ? Z80::InLoop24r : Z80::InLoop16r;
+    SDValue Ops[] = {
+      Mem, Port, DAG.getZExtOrTrunc(Size, dl, Is24Bit ? MVT::i24 : MVT::i16),
+      Chain
+    };
+    return SDValue(DAG.getMachineNode(Opc, dl, MVT::Other, Ops), 0);
+  }
+  uint64_t Count = ConstSize->getZExtValue();
+  if (!Count)
+    return Chain;
+
+  // OTIMR and INIMR count in B and only increment C, so they need a constant
+  // port that stays below 0x100.
+  auto *ConstPort = dyn_cast<ConstantSDNode>(Port);
+  if ((ToPort ? STI.hasZ180Ops() : STI.hasEZ80Ops()) && ConstPort &&
+      Count <= 0x100 && ConstPort->getZExtValue() + Count <= 0x100) {
+    SDValue Glue;
+    Chain = DAG.getCopyToReg(Chain, dl, Is24Bit ? Z80::UHL : Z80::HL, Mem,
+                             Glue);
+    Glue = Chain.getValue(1);
+    Chain = DAG.getCopyToReg(Chain, dl, Z80::B,
+                             DAG.getConstant(Count & 0xFF, dl, MVT::i8), Glue);
+    Glue = Chain.getValue(1);
+    Chain = DAG.getCopyToReg(Chain, dl, Z80::C,
+                             DAG.getConstant(ConstPort->getZExtValue(), dl,
+                                             MVT::i8), Glue);
+    Glue = Chain.getValue(1);
+    unsigned Opc = ToPort ? Is24Bit ? Z80::OTIMR24 : Z80::OTIMR16
+                          : Is24Bit ? Z80::INIMR24 : Z80::INIMR16;
+    return SDValue(DAG.getMachineNode(Opc, dl, MVT::Other, Chain, Glue), 0);
+  }
+
+  // Each loop counts at most 256 bytes in a byte register.
+  if (Count > MaxUnrolledPortCopy) {
+    unsigned Opc = ToPort ? Is24Bit ? Z80::OutLoop24 : Z80::OutLoop16
+                          : Is24Bit ? Z80::InLoop24 : Z80::InLoop16;
+    for (uint64_t I = 0; I < Count; I += 0x100) {
+      SDValue Ops[] = {
+        DAG.getMemBasePlusOffset(Mem, I, dl),
+        I ? DAG.getNode(ISD::ADD, dl, MVT::i16, Port,
+                        DAG.getConstant(I, dl, MVT::i16)) : Port,
+        DAG.getTargetConstant(std::min<uint64_t>(Count - I, 0x100) & 0xFF, dl,
+                              MVT::i8),
+        Chain
+      };
+      Chain = SDValue(DAG.getMachineNode(Opc, dl, MVT::Other, Ops), 0);
+    }
+    return Chain;
+  }
+
+  SmallVector<SDValue, 8> Chains;
+  for (uint64_t I = 0; I != Count; ++I) {
+    SDValue PortI = DAG.getNode(ISD::ADD, dl, MVT::i16, Port,
+                                DAG.getConstant(I, dl, MVT::i16));
+    SDValue MemI = DAG.getMemBasePlusOffset(Mem, I, dl);
+    if (ToPort) {
+      SDValue Byte = DAG.getLoad(MVT::i8, dl, Chain, MemI,
+                                 SrcPtrInfo.getWithOffset(I), 1);
+      Chain = DAG.getNode(Z80ISD::OUT, dl, MVT::Other, Byte.getValue(1), Byte,
+                          PortI);
+    } else {
+      SDValue Byte = DAG.getNode(Z80ISD::IN, dl,
+                                 DAG.getVTList(MVT::i8, MVT::Other),
+                                 Chain, PortI);
+      Chain = Byte.getValue(1);
+      Chains.push_back(DAG.getStore(Chain, dl, Byte, MemI,
+                                    DstPtrInfo.getWithOffset(I), 1));
+    }
+  }
+  if (Chains.empty())
+    return Chain;
+  Chains.push_back(Chain);
+  return DAG.getNode(ISD::TokenFactor, dl, MVT::Other, Chains);
+}
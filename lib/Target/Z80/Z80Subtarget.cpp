@@ -14,6 +14,7 @@
 #include "Z80Subtarget.h"
 #include "MCTargetDesc/Z80MCTargetDesc.h"
 #include "Z80FrameLowering.h"
+#include "llvm/Support/CommandLine.h"
 using namespace llvm;
 
 #define DEBUG_TYPE "z80-subtarget"
@@ -22,6 +23,11 @@ using namespace llvm;
 #define GET_SUBTARGETINFO_CTOR
 #include "Z80GenSubtargetInfo.inc"
 
+static cl::opt<bool>
+    Z80SubRegLiveness("z80-subreg-liveness",
+                      cl::desc("Track the liveness of register halves"),
+                      cl::init(true), cl::Hidden);
+
 Z80Subtarget &Z80Subtarget::initializeSubtargetDependencies(StringRef CPU,
                                                             StringRef FS) {
   ParseSubtargetFeatures(CPU, FS);
@@ -38,3 +44,9 @@ Z80Subtarget::Z80Subtarget(const Triple &TT, const std::string &CPU,
       InstrInfo(initializeSubtargetDependencies(CPU, FS)),
       TLInfo(TM, *this), FrameLowering(*this) {
 }
+
+bool Z80Subtarget::enableSubRegLiveness() const {
+  // With so few registers, keeping a byte in the unused half of a pair is
+  // worth the extra tracking.
+  return Z80SubRegLiveness;
+}
@@ -61,7 +61,7 @@ public:
   Z80Subtarget(const Triple &TT, const std::string &CPU, const std::string &FS,
                const Z80TargetMachine &TM);
 
-  //bool enableSubRegLiveness() const override { return true; }
+  bool enableSubRegLiveness() const override;
 
   const Z80SelectionDAGInfo *getSelectionDAGInfo() const override {
     return &TSInfo;
@@ -13,13 +13,21 @@
 
 #include "Z80TargetMachine.h"
 #include "Z80.h"
+#include "Z80TargetObjectFile.h"
+#include "Z80TargetTransformInfo.h"
 #include "llvm/CodeGen/Passes.h"
 #include "llvm/CodeGen/TargetPassConfig.h"
-#include "llvm/CodeGen/TargetLoweringObjectFileImpl.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Transforms/Scalar.h"
 using namespace llvm;
 
+static cl::opt<bool> UseIPRA(
+    "z80-ipra",
+    cl::desc("Use interprocedural register allocation, so that callers and "
+             "interrupt handlers only save what their callees clobber"),
+    cl::init(true), cl::Hidden);
+
 extern "C" void LLVMInitializeZ80Target() {
   // Register the target.
   RegisterTargetMachine<Z80TargetMachine> X(TheZ80Target);
@@ -60,7 +68,7 @@ Z80TargetMachine::Z80TargetMachine(const Target &T, const Triple &TT,
                                    CodeModel::Model CM, CodeGenOpt::Level OL)
   : LLVMTargetMachine(T, computeDataLayout(TT), TT, CPU, FS, Options,
                       getEffectiveRelocModel(RM), CM, OL),
-    TLOF(make_unique<TargetLoweringObjectFileOMF>()) {
+    TLOF(make_unique<Z80TargetObjectFile>()) {
   initAsmInfo();
 }
 
@@ -94,6 +102,16 @@ Z80TargetMachine::getSubtargetImpl(const Function &F) const {
   return I.get();
 }
 
+bool Z80TargetMachine::useIPRA() const {
+  return UseIPRA;
+}
+
+TargetIRAnalysis Z80TargetMachine::getTargetIRAnalysis() {
+  return TargetIRAnalysis([this](const Function &F) {
+    return TargetTransformInfo(Z80TTIImpl(this, F));
+  });
+}
+
 //===----------------------------------------------------------------------===//
 // Pass Pipeline Configuration
 //===----------------------------------------------------------------------===//
@@ -109,11 +127,12 @@ public:
     return getTM<Z80TargetMachine>();
   }
 
+  void addIRPasses() override;
   void addCodeGenPrepare() override;
   bool addInstSelector() override;
+  void addPostRegAlloc() override;
+  void addPreSched2() override;
 //void addPreRegAlloc() override;
-//bool addPreRewrite() override;
-//void addPreSched2() override;
 };
 } // namespace
 
@@ -121,6 +140,12 @@ TargetPassConfig *Z80TargetMachine::createPassConfig(PassManagerBase &PM) {
   return new Z80PassConfig(this, PM);
 }
 
+void Z80PassConfig::addIRPasses() {
+  TargetPassConfig::addIRPasses();
+  if (getOptLevel() != CodeGenOpt::None)
+    addPass(createZ80IntegerNarrowingPass());
+}
+
 void Z80PassConfig::addCodeGenPrepare() {
   addPass(createLowerSwitchPass());
   TargetPassConfig::addCodeGenPrepare();
@@ -132,21 +157,27 @@ bool Z80PassConfig::addInstSelector() {
   return false;
 }
 
-/*void Z80PassConfig::addPreRegAlloc() {
-  TargetPassConfig::addPreRegAlloc();
-  if (getOptLevel() != CodeGenOpt::None)
-    ;//addPass(createZ80CallFrameOptimization());
+void Z80PassConfig::addPostRegAlloc() {
+  // Runs after stack slot coloring so that only the slots left over are
+  // considered, and before prologue insertion so removed slots shrink the frame.
+  if (getOptLevel() != CodeGenOpt::None) {
+    addPass(createZ80CopyShuffles());
+    addPass(createZ80PushPopSpills());
+  }
 }
 
-bool Z80PassConfig::addPreRewrite() {
-  //addPass(createZ80ExpandPseudoPass());
-  return TargetPassConfig::addPreRewrite();
+void Z80PassConfig::addPreSched2() {
+  // Runs after ExpandPostRAPseudos has handled the single instruction pseudos,
+  // and is required for correctness, so even at -O0.
+  addPass(createZ80ExpandPseudoPass());
+  // Z80MachineLateOptimization must also run after ExpandPostRAPseudos.
+  //if (getOptLevel() != CodeGenOpt::None)
+  //  addPass(createZ80MachineLateOptimization());
 }
 
-void Z80PassConfig::addPreSched2() {
-  // Z80MachineLateOptimization pass must be run after ExpandPostRAPseudos
+/*void Z80PassConfig::addPreRegAlloc() {
+  TargetPassConfig::addPreRegAlloc();
   if (getOptLevel() != CodeGenOpt::None)
-    addPass(createZ80MachineLateOptimization());
-  TargetPassConfig::addPreSched2();
+    ;//addPass(createZ80CallFrameOptimization());
 }
 */
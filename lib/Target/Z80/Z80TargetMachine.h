@@ -31,6 +31,13 @@ public:
   ~Z80TargetMachine() override;
   const Z80Subtarget *getSubtargetImpl(const Function &F) const override;
 
+  /// Calls clobber nearly every register, so knowing what a callee really
+  /// uses saves a lot of spilling around calls and in interrupt handlers.
+  bool useIPRA() const override;
+
+  /// \brief Get a TargetIRAnalysis appropriate for the target.
+  TargetIRAnalysis getTargetIRAnalysis() override;
+
   // Set up the pass pipeline.
   TargetPassConfig *createPassConfig(PassManagerBase &PM) override;
   TargetLoweringObjectFile *getObjFileLowering() const override {
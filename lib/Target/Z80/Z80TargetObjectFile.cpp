@@ -0,0 +1,93 @@
+//===-- Z80TargetObjectFile.cpp - Z80 Object Files ------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Z80TargetObjectFile.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCSectionOMF.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Target/TargetMachine.h"
+using namespace llvm;
+
+static cl::opt<unsigned>
+SmallDataThreshold("z80-sdata-threshold", cl::Hidden, cl::init(0),
+                   cl::desc("Place writable globals up to this many bytes in "
+                            "the IY-relative SDATA section (0 disables the "
+                            "small data area and leaves IY allocatable)"));
+
+static const char *const SmallDataSectionName = "SDATA";
+
+void Z80TargetObjectFile::Initialize(MCContext &Ctx, const TargetMachine &TM) {
+  TargetLoweringObjectFileOMF::Initialize(Ctx, TM);
+  SmallDataGlobals.clear();
+  SmallDataSize = 0;
+}
+
+void Z80TargetObjectFile::addSmallDataGlobal(const GlobalObject *GO) const {
+  if (!SmallDataGlobals.insert(GO).second)
+    return;
+  const DataLayout &DL = GO->getParent()->getDataLayout();
+  uint64_t OldSize = SmallDataSize;
+  SmallDataSize += DL.getTypeAllocSize(GO->getValueType());
+  // IY points 128 bytes into the section, so displacements reach 256 bytes.
+  if (OldSize <= 256 && SmallDataSize > 256)
+    GO->getContext().emitError("small data area overflows the 256 bytes "
+                               "reachable from IY at '" + GO->getName() +
+                               "', lower -z80-sdata-threshold");
+}
+
+bool Z80TargetObjectFile::hasSmallData() {
+  return SmallDataThreshold != 0;
+}
+
+bool Z80TargetObjectFile::isGlobalInSmallSection(
+    const GlobalObject *GO, const TargetMachine &TM) const {
+  // Declarations get the same answer as their definition since it only
+  // depends on the type and attributes.
+  if (GO->isDeclaration() || GO->hasAvailableExternallyLinkage()) {
+    auto *GVA = dyn_cast<GlobalVariable>(GO);
+    return GVA && !GVA->isConstant() && !GVA->isThreadLocal() &&
+      isGlobalInSmallSection(GO, TM, SectionKind::getData());
+  }
+  return isGlobalInSmallSection(GO, TM, getKindForGlobal(GO, TM));
+}
+
+bool Z80TargetObjectFile::isGlobalInSmallSection(
+    const GlobalObject *GO, const TargetMachine &TM, SectionKind Kind) const {
+  if (!hasSmallData())
+    return false;
+  auto *GVA = dyn_cast<GlobalVariable>(GO);
+  if (!GVA || (!Kind.isData() && !Kind.isBSS()))
+    return false;
+  // An explicit SDATA section lets hot globals in regardless of size.
+  if (GVA->hasSection())
+    return GVA->getSection() == SmallDataSectionName;
+  Type *Ty = GVA->getValueType();
+  if (!Ty->isSized())
+    return false;
+  return GVA->getParent()->getDataLayout().getTypeAllocSize(Ty) <=
+    SmallDataThreshold;
+}
+
+MCSection *Z80TargetObjectFile::getExplicitSectionGlobal(
+    const GlobalObject *GO, SectionKind Kind, const TargetMachine &TM) const {
+  if (isGlobalInSmallSection(GO, TM, Kind))
+    addSmallDataGlobal(GO);
+  return getContext().getOMFSection(GO->getSection(), Kind);
+}
+
+MCSection *Z80TargetObjectFile::SelectSectionForGlobal(
+    const GlobalObject *GO, SectionKind Kind, const TargetMachine &TM) const {
+  if (isGlobalInSmallSection(GO, TM, Kind)) {
+    addSmallDataGlobal(GO);
+    return getContext().getOMFSection(SmallDataSectionName, Kind);
+  }
+  return TargetLoweringObjectFileOMF::SelectSectionForGlobal(GO, Kind, TM);
+}
@@ -0,0 +1,55 @@
+//===-- Z80TargetObjectFile.h - Z80 Object Info -----------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_LIB_TARGET_Z80_Z80TARGETOBJECTFILE_H
+#define LLVM_LIB_TARGET_Z80_Z80TARGETOBJECTFILE_H
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/CodeGen/TargetLoweringObjectFileImpl.h"
+
+namespace llvm {
+
+/// Z80 object file lowering, which places small globals in an SDATA section
+/// that is addressed relative to IY when the small data area is enabled.
+class Z80TargetObjectFile : public TargetLoweringObjectFileOMF {
+  /// Globals defined in SDATA by this module, and the bytes they take.
+  mutable SmallPtrSet<const GlobalObject *, 16> SmallDataGlobals;
+  mutable uint64_t SmallDataSize = 0;
+
+  /// Count GO, which is defined in SDATA, against the reach of (iy + d).
+  void addSmallDataGlobal(const GlobalObject *GO) const;
+
+public:
+  void Initialize(MCContext &Ctx, const TargetMachine &TM) override;
+
+  /// Return true if IY is reserved to point into the small data area.  IY is
+  /// caller saved in the C convention, so code built without the area may
+  /// clobber it; calls to anything not defined in the same module reload it
+  /// afterwards.
+  static bool hasSmallData();
+
+  /// Return the symbol IY is set to by the runtime, 128 bytes past the start
+  /// of SDATA so that signed displacements cover the whole 256-byte window.
+  static const char *getSmallDataBaseName() { return "__sdata_origin"; }
+
+  /// Return true if GO should be placed in the small data section.
+  bool isGlobalInSmallSection(const GlobalObject *GO,
+                              const TargetMachine &TM) const;
+  bool isGlobalInSmallSection(const GlobalObject *GO, const TargetMachine &TM,
+                              SectionKind Kind) const;
+
+  MCSection *getExplicitSectionGlobal(const GlobalObject *GO, SectionKind Kind,
+                                      const TargetMachine &TM) const override;
+  MCSection *SelectSectionForGlobal(const GlobalObject *GO, SectionKind Kind,
+                                    const TargetMachine &TM) const override;
+};
+
+} // end namespace llvm
+
+#endif
@@ -0,0 +1,155 @@
+//===-- Z80TargetTransformInfo.cpp - Z80 specific TTI pass ----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file
+/// This file implements a TargetTransformInfo analysis pass specific to the
+/// Z80 target machine.  Costs are in units of one 8-bit ALU operation, since
+/// that is the only thing the hardware does natively.
+///
+//===----------------------------------------------------------------------===//
+
+#include "Z80TargetTransformInfo.h"
+#include "Z80TargetObjectFile.h"
+#include "llvm/IR/Constants.h"
+using namespace llvm;
+
+#define DEBUG_TYPE "z80tti"
+
+/// Rough cost of handing an operation to a runtime helper: argument setup,
+/// the call and return, and a few iterations of the helper's loop.
+static const int LibCallCost = 8 * TargetTransformInfo::TCC_Expensive;
+
+/// Return the number of bytes the legalizer splits a value of type Ty into.
+static unsigned getByteSize(Type *Ty) {
+  return (Ty->getScalarSizeInBits() + 7) / 8;
+}
+
+unsigned Z80TTIImpl::getOperationCost(unsigned Opcode, Type *Ty, Type *OpTy) {
+  switch (Opcode) {
+  case Instruction::Mul:
+    if (getByteSize(Ty) == 1 && ST->hasZ180Ops())
+      break;
+    return TTI::TCC_Expensive;
+  case Instruction::Shl:
+  case Instruction::LShr:
+  case Instruction::AShr:
+    if (getByteSize(Ty) <= (ST->is24Bit() ? 3u : 2u))
+      break;
+    return TTI::TCC_Expensive;
+  case Instruction::FAdd:
+  case Instruction::FSub:
+  case Instruction::FMul:
+  case Instruction::FPToSI:
+  case Instruction::FPToUI:
+  case Instruction::SIToFP:
+  case Instruction::UIToFP:
+  case Instruction::FPExt:
+  case Instruction::FPTrunc:
+    // Floats are softened into runtime calls.
+    return TTI::TCC_Expensive;
+  }
+  return BaseT::getOperationCost(Opcode, Ty, OpTy);
+}
+
+unsigned Z80TTIImpl::getNumberOfRegisters(bool Vector) {
+  if (Vector)
+    return 0;
+  // HL, DE, BC and IY, with IX kept as the frame pointer and IY possibly
+  // reserved for the small data area.
+  return Z80TargetObjectFile::hasSmallData() ? 3 : 4;
+}
+
+unsigned Z80TTIImpl::getRegisterBitWidth(bool Vector) const {
+  if (Vector)
+    return 0;
+  return ST->is24Bit() ? 24 : 16;
+}
+
+unsigned Z80TTIImpl::getMaxInterleaveFactor(unsigned VF) {
+  return 1;
+}
+
+int Z80TTIImpl::getArithmeticInstrCost(
+    unsigned Opcode, Type *Ty, TTI::OperandValueKind Opd1Info,
+    TTI::OperandValueKind Opd2Info, TTI::OperandValueProperties Opd1PropInfo,
+    TTI::OperandValueProperties Opd2PropInfo, ArrayRef<const Value *> Args) {
+  if (Ty->isVectorTy())
+    return BaseT::getArithmeticInstrCost(Opcode, Ty, Opd1Info, Opd2Info,
+                                         Opd1PropInfo, Opd2PropInfo, Args);
+  if (Ty->isFloatingPointTy())
+    return Ty->isDoubleTy() ? 2 * LibCallCost : LibCallCost;
+
+  unsigned Bytes = getByteSize(Ty);
+  unsigned PtrBytes = ST->is24Bit() ? 3 : 2;
+  // i64 operations are done in memory by the runtime.
+  if (Bytes > 4)
+    return 2 * LibCallCost;
+
+  bool ConstAmt = Opd2Info == TTI::OK_UniformConstantValue ||
+                  Opd2Info == TTI::OK_NonUniformConstantValue;
+  switch (Opcode) {
+  default:
+    break;
+  case Instruction::Add:
+  case Instruction::Sub:
+    // Pointer sized values use ADD/SBC HL, anything else is chained through A
+    // a byte at a time.
+    if (Bytes == 1)
+      return TTI::TCC_Basic;
+    if (Bytes <= PtrBytes)
+      return 2 * TTI::TCC_Basic;
+    return 2 * Bytes * TTI::TCC_Basic;
+  case Instruction::And:
+  case Instruction::Or:
+  case Instruction::Xor:
+    // Every byte but one has to be moved through A and back.
+    return (Bytes == 1 ? 1 : 3 * Bytes) * TTI::TCC_Basic;
+  case Instruction::Shl:
+  case Instruction::LShr:
+  case Instruction::AShr: {
+    if (!ConstAmt)
+      return Bytes == 1 ? 4 * TTI::TCC_Basic : LibCallCost;
+    // Whole bytes are moved, the remaining bits cost a shift per byte each.
+    unsigned Bits = 4;
+    if (Args.size() == 2)
+      if (auto *Amt = dyn_cast<ConstantInt>(Args[1]))
+        Bits = Amt->getZExtValue() % 8;
+    return (Bits + 1) * Bytes * TTI::TCC_Basic;
+  }
+  case Instruction::Mul:
+    if (Bytes == 1 && ST->hasZ180Ops())
+      return 2 * TTI::TCC_Basic;
+    return Bytes * LibCallCost / 2;
+  case Instruction::UDiv:
+  case Instruction::URem:
+    if (Opd2PropInfo == TTI::OP_PowerOf2 && ConstAmt)
+      return getArithmeticInstrCost(Opcode == Instruction::UDiv
+                                        ? Instruction::LShr
+                                        : Instruction::And,
+                                    Ty, Opd1Info, Opd2Info);
+    LLVM_FALLTHROUGH;
+  case Instruction::SDiv:
+  case Instruction::SRem:
+    return Bytes * LibCallCost;
+  }
+  return BaseT::getArithmeticInstrCost(Opcode, Ty, Opd1Info, Opd2Info,
+                                       Opd1PropInfo, Opd2PropInfo, Args);
+}
+
+void Z80TTIImpl::getUnrollingPreferences(Loop *L, ScalarEvolution &SE,
+                                         TTI::UnrollingPreferences &UP) {
+  // Code size is at a premium and there is no pipeline to fill, so only
+  // fully unroll loops that get smaller or barely bigger by doing so.
+  UP.Threshold = 16;
+  UP.PartialThreshold = 0;
+  UP.OptSizeThreshold = 0;
+  UP.PartialOptSizeThreshold = 0;
+  UP.Partial = false;
+  UP.Runtime = false;
+  UP.AllowExpensiveTripCount = false;
+}
@@ -0,0 +1,67 @@
+//===-- Z80TargetTransformInfo.h - Z80 specific TTI -------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+/// \file
+/// This file defines a TargetTransformInfo::Concept conforming object specific
+/// to the Z80 target machine. It uses the target's detailed information to
+/// provide more precise answers to certain TTI queries, while letting the
+/// target independent and default TTI implementations handle the rest.
+///
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_LIB_TARGET_Z80_Z80TARGETTRANSFORMINFO_H
+#define LLVM_LIB_TARGET_Z80_Z80TARGETTRANSFORMINFO_H
+
+#include "Z80TargetMachine.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/CodeGen/BasicTTIImpl.h"
+
+namespace llvm {
+
+class Z80TTIImpl : public BasicTTIImplBase<Z80TTIImpl> {
+  typedef BasicTTIImplBase<Z80TTIImpl> BaseT;
+  typedef TargetTransformInfo TTI;
+  friend BaseT;
+
+  const Z80Subtarget *ST;
+  const Z80TargetLowering *TLI;
+
+  const Z80Subtarget *getST() const { return ST; }
+  const Z80TargetLowering *getTLI() const { return TLI; }
+
+public:
+  explicit Z80TTIImpl(const Z80TargetMachine *TM, const Function &F)
+      : BaseT(TM, F.getParent()->getDataLayout()), ST(TM->getSubtargetImpl(F)),
+        TLI(ST->getTargetLowering()) {}
+
+  /// \name Scalar TTI Implementations
+  /// @{
+  unsigned getOperationCost(unsigned Opcode, Type *Ty, Type *OpTy);
+  /// @}
+
+  /// \name Vector TTI Implementations
+  /// @{
+  unsigned getNumberOfRegisters(bool Vector);
+  unsigned getRegisterBitWidth(bool Vector) const;
+  unsigned getMaxInterleaveFactor(unsigned VF);
+  int getArithmeticInstrCost(
+      unsigned Opcode, Type *Ty,
+      TTI::OperandValueKind Opd1Info = TTI::OK_AnyValue,
+      TTI::OperandValueKind Opd2Info = TTI::OK_AnyValue,
+      TTI::OperandValueProperties Opd1PropInfo = TTI::OP_None,
+      TTI::OperandValueProperties Opd2PropInfo = TTI::OP_None,
+      ArrayRef<const Value *> Args = ArrayRef<const Value *>());
+  /// @}
+
+  void getUnrollingPreferences(Loop *L, ScalarEvolution &SE,
+                               TTI::UnrollingPreferences &UP);
+};
+
+} // end namespace llvm
+
+#endif
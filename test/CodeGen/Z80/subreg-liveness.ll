@@ -0,0 +1,50 @@
+; RUN: llc -mtriple=z80 < %s | FileCheck %s --check-prefix=LIVE
+; RUN: llc -mtriple=z80 -z80-subreg-liveness=false < %s \
+; RUN:   | FileCheck %s --check-prefix=NOLIVE
+
+; Only the low byte of %w is used, so its pair has a free upper half while
+; six loaded bytes are live.  With subregister liveness that half holds one of
+; them and nothing is spilled, without it the pair stays occupied and a byte
+; has to go to the stack.
+
+@src = global [6 x i8] zeroinitializer
+@dst = global [7 x i8] zeroinitializer
+
+define void @half() nounwind {
+; LIVE-LABEL: half:
+; LIVE-NOT: push
+; LIVE-NOT: (ix
+; LIVE: ret
+; NOLIVE-LABEL: half:
+; NOLIVE: {{push|\(ix}}
+; NOLIVE: ret
+  %w = call i16 asm sideeffect "ld $0, 0x1234", "=r"()
+  %lo = trunc i16 %w to i8
+  %p0 = getelementptr [6 x i8], [6 x i8]* @src, i16 0, i16 0
+  %p1 = getelementptr [6 x i8], [6 x i8]* @src, i16 0, i16 1
+  %p2 = getelementptr [6 x i8], [6 x i8]* @src, i16 0, i16 2
+  %p3 = getelementptr [6 x i8], [6 x i8]* @src, i16 0, i16 3
+  %p4 = getelementptr [6 x i8], [6 x i8]* @src, i16 0, i16 4
+  %p5 = getelementptr [6 x i8], [6 x i8]* @src, i16 0, i16 5
+  %v0 = load volatile i8, i8* %p0
+  %v1 = load volatile i8, i8* %p1
+  %v2 = load volatile i8, i8* %p2
+  %v3 = load volatile i8, i8* %p3
+  %v4 = load volatile i8, i8* %p4
+  %v5 = load volatile i8, i8* %p5
+  %q0 = getelementptr [7 x i8], [7 x i8]* @dst, i16 0, i16 0
+  %q1 = getelementptr [7 x i8], [7 x i8]* @dst, i16 0, i16 1
+  %q2 = getelementptr [7 x i8], [7 x i8]* @dst, i16 0, i16 2
+  %q3 = getelementptr [7 x i8], [7 x i8]* @dst, i16 0, i16 3
+  %q4 = getelementptr [7 x i8], [7 x i8]* @dst, i16 0, i16 4
+  %q5 = getelementptr [7 x i8], [7 x i8]* @dst, i16 0, i16 5
+  %q6 = getelementptr [7 x i8], [7 x i8]* @dst, i16 0, i16 6
+  store volatile i8 %v5, i8* %q0
+  store volatile i8 %v4, i8* %q1
+  store volatile i8 %v3, i8* %q2
+  store volatile i8 %v2, i8* %q3
+  store volatile i8 %v1, i8* %q4
+  store volatile i8 %v0, i8* %q5
+  store volatile i8 %lo, i8* %q6
+  ret void
+}
@@ -8565,6 +8565,8 @@ public:
 };
 
 class Z80TargetInfoBase : public TargetInfo {
+  static const Builtin::Info BuiltinInfo[];
+
 public:
   Z80TargetInfoBase(const llvm::Triple &Triple) : TargetInfo(Triple) {
     TLSSupported = false;
@@ -8578,16 +8580,41 @@ public:
     UseBitFieldTypeAlignment = false;
   }
   bool hasInt48Type() const override { return true; }
-  ArrayRef<Builtin::Info> getTargetBuiltins() const final { return None; }
+  ArrayRef<Builtin::Info> getTargetBuiltins() const final {
+    return llvm::makeArrayRef(BuiltinInfo, clang::Z80::LastTSBuiltin -
+                                               Builtin::FirstTSBuiltin);
+  }
   BuiltinVaListKind getBuiltinVaListKind() const override {
     return TargetInfo::CharPtrBuiltinVaList;
   }
   bool validateAsmConstraint(const char *&Name,
                              TargetInfo::ConstraintInfo &Info) const override {
-    return false;
+    switch (*Name) {
+    default:
+      return false;
+    case 'a': // Specific registers, or the pairs that b, d and h start.
+    case 'b':
+    case 'c':
+    case 'd':
+    case 'e':
+    case 'h':
+    case 'l':
+    case 'x': // IX
+    case 'y': // IY
+    case 'q': // Any register that isn't part of an index register.
+    case 'w': // Any index register.
+      Info.setAllowsRegister();
+      return true;
+    }
   }
   const char *getClobbers() const override { return ""; }
-  ArrayRef<const char *> getGCCRegNames() const override { return None; }
+  ArrayRef<const char *> getGCCRegNames() const override {
+    static const char *const GCCRegNames[] = {
+      "a", "f", "b", "c", "d", "e", "h", "l", "ixh", "ixl", "iyh", "iyl",
+      "af", "bc", "de", "hl", "ix", "iy", "sp"
+    };
+    return llvm::makeArrayRef(GCCRegNames);
+  }
   ArrayRef<TargetInfo::GCCRegAlias> getGCCRegAliases() const override {
     return None;
   }
@@ -8597,6 +8624,12 @@ public:
   }
 };
 
+const Builtin::Info Z80TargetInfoBase::BuiltinInfo[] = {
+#define BUILTIN(ID, TYPE, ATTRS) \
+  { #ID, TYPE, ATTRS, nullptr, ALL_LANGUAGES, nullptr },
+#include "clang/Basic/BuiltinsZ80.def"
+};
+
 class Z80TargetInfo : public Z80TargetInfoBase {
 public:
   explicit Z80TargetInfo(const llvm::Triple &T) : Z80TargetInfoBase(T) {
@@ -8604,6 +8637,11 @@ public:
     resetDataLayout("e-m:o-p:16:8-p1:8:8-i16:8-i24:8-i32:8-i48:8-i64:8-i96:8-f32:8-f64:8-a:8-n8:16-S8");
   }
 
+  // Address space 1 holds I/O port addresses.
+  uint64_t getPointerWidthV(unsigned AddrSpace) const override {
+    return AddrSpace == 1 ? 8 : PointerWidth;
+  }
+
 private:
   bool setCPU(const std::string &Name) override {
     return llvm::StringSwitch<bool>(Name)
@@ -8646,6 +8684,18 @@ public:
       resetDataLayout("e-m:o-p:24:8-p1:16:8-p2:16:8-i16:8-i24:8-i32:8-i48:8-i64:8-i96:8-f32:8-f64:8-a:8-n8:16:24-S8");
     }
   }
+
+  // Address space 1 holds I/O port addresses.  Address space 2 holds the
+  // pointers of the other mode: 16-bit pointers relative to MBASE in ADL mode,
+  // and full 24-bit pointers in Z80 mode.
+  uint64_t getPointerWidthV(unsigned AddrSpace) const override {
+    if (AddrSpace == 1)
+      return 16;
+    if (AddrSpace == 2)
+      return PointerWidth == 24 ? 16 : 24;
+    return PointerWidth;
+  }
+
 private:
   bool setCPU(const std::string &Name) override {
     return llvm::StringSwitch<bool>(Name)
@@ -8658,6 +8708,9 @@ private:
                         MacroBuilder &Builder) const override {
     Z80TargetInfoBase::getTargetDefines(Opts, Builder);
     defineCPUMacros(Builder, "EZ80", /*Tuning=*/false);
+    // 24-bit pointers can't be lowered in Z80 mode yet, so there is no __far.
+    if (PointerWidth == 24)
+      Builder.defineMacro("__near", "__attribute__((address_space(2)))");
   }
 };
 